@@ -1,201 +1,3783 @@
 // Q-learning Grid World in C (single-file, no deps)
-// Build: gcc -O2 -Wall -Wextra -std=c11 qgrid.c -o qgrid
+// Build: gcc -O2 -Wall -Wextra -std=c11 -pthread qgrid.c -o qgrid -lm
 // Usage examples:
 //   ./qgrid --train 10000 --save qtable.bin
 //   ./qgrid --load qtable.bin --render --play 3
 //   ./qgrid --train 5000 --render --seed 42
+//   ./qgrid --train 20000 --threads 4 --sharded
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE   // madvise(MADV_HUGEPAGE)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define MAX_W 10
-#define MAX_H 10
+#define MAX_W 16384
+#define MAX_H 16384
 #define ACTIONS 4   // 0=up,1=right,2=down,3=left
+#define CACHE_LINE 64
+#define HUGE_PAGE (2u << 20)
+#define MAX_THREADS 256
+#define MAX_SHARDED_THREADS 64   // --sharded allocates threads^2 mailboxes (~16 KiB each)
+#define CLOCK_CHECK_STEPS 4096   // training budget: read the clock every N steps (power of two)
+
+typedef struct Symmetry Symmetry;
 
 typedef struct {
     int w, h;
     int start_x, start_y;
     int goal_x, goal_y;
-    int walls[MAX_H][MAX_W];  // 1 if wall
+    unsigned char *walls;     // w*h, row-major, 1 if wall
     int step_limit;
     float step_reward;   // typically -1.0
     float goal_reward;   // e.g., +10.0
+    const Symmetry *sym; // Q stored for canonical states only (NULL = every state)
 } Env;
 
-typedef struct {
-    int x, y;
-} Pos;
+typedef struct {
+    int x, y;
+} Pos;
+
+typedef struct {
+    // Q-table dims: (h*w) x ACTIONS
+    int w, h;
+    float *q; // size = w*h*ACTIONS, CACHE_LINE-aligned
+    void *map;        // non-NULL: q points into this mmap'd file (see load_qtable)
+    size_t map_bytes;
+} QModel;
+
+typedef struct {
+    int episodes;
+    float alpha, gamma;
+    float eps_start, eps_min, eps_decay;
+    int render_every;
+    int threads;        // >1 runs parallel training
+    int sharded;        // parallel: 1 = owner-computes shards, 0 = shared table
+    int count_sharing;  // parallel: track cross-thread cache-line writes
+    int check_every;    // test greedy optimality every K episodes (0=off)
+    int check_all;      // check every state instead of the start only
+    const int *dist;    // goal distances for the check (env_goal_distances)
+    int shape;          // potential-based reward shaping from dist
+    int psweep;         // prioritized sweeping: planning updates per step (0=off)
+    float psweep_theta; // prioritized sweeping: queue threshold on |TD error|
+    int dyna;           // Dyna-Q: planning updates per real step (0=off)
+    int replay;         // replay buffer capacity (0=off: online updates)
+    int replay_batch;   // replay minibatch size, one minibatch per step
+    int replay_sort;    // sort minibatches by state id
+    float lambda;       // Watkins Q(lambda) trace decay (0=one-step Q-learning)
+    float trace_min;    // traces below this are pruned
+    int backward;       // replay each episode backwards when it ends
+    int nstep;          // n-step Q-learning (<=1 = one-step)
+    double max_seconds; // wall-clock budget (0=none); episodes<=0 = no episode cap
+    long long max_steps;// environment step budget (0=none)
+    int start_mode;     // START_* exploring-starts mode
+    int start_ramp;     // reverse curriculum: episodes to open the whole map
+    const char *checkpoint_path; // periodic checkpoints of the table (NULL=off)
+    int checkpoint_every;        // ... every N episodes
+    double checkpoint_seconds;   // ... or every T seconds
+    const void *resume;          // training state to continue from (NULL=fresh)
+    size_t resume_bytes;
+    void **state_out;            // receives the final training state (malloc'd)
+    size_t *state_out_bytes;
+} TrainConfig;
+
+typedef struct {
+    int episodes;       // episodes actually run
+    long long steps;    // environment steps
+    long long updates;  // Q updates, real and planned
+    int optimal;        // stopped early: greedy policy proved optimal
+    int budget;         // stopped early: --train-seconds/--train-steps used up
+    double seconds;
+} TrainResult;
+
+// Small per-thread RNG (splitmix64); rand() is neither thread-safe nor fast.
+typedef struct {
+    uint64_t s;
+} Rng;
+
+// Reflections/rotations that map the walls and goal onto themselves (see
+// symmetry_detect). Transform k sends (x,y) to (m[k][0]x + m[k][1]y + m[k][2],
+// m[k][3]x + m[k][4]y + m[k][5]) and action a to perm[k][a]. Cell s reads the
+// Q row of its canonical image under t[s]; canonical cells fill a prefix
+// [0, row[y+1]-row[y]) of each row, so the row index is row[y'] + x'.
+#define SYM_SWAP   1   // transpose (square maps)
+#define SYM_FLIP_X 2
+#define SYM_FLIP_Y 4
+struct Symmetry {
+    int w, h, count;        // count: canonical states (Q rows)
+    uint64_t inv_w;         // ceil(2^46 / w): s / w without a divide (exact for s*w < 2^46)
+    int n, k[8];            // transforms in the group, identity first
+    int m[8][6];
+    unsigned char perm[8][ACTIONS];
+    unsigned char *t;       // [S] transform taking s to its canonical state
+    int *row;               // [h+1]
+};
+
+static inline int clamp(int v, int lo, int hi){ return v<lo?lo:(v>hi?hi:v); }
+static inline int state_id(const Env *env, int x, int y){ return y*env->w + x; }
+static inline int sym_row(const Symmetry *sy, int s){
+    int y = (int)(((uint64_t)s * sy->inv_w) >> 46), x = s - y*sy->w;
+    const int *m = sy->m[sy->t[s]];
+    return sy->row[m[3]*x + m[4]*y + m[5]] + m[0]*x + m[1]*y + m[2];
+}
+static inline int idxQ(const Env *env, int s, int a){
+    const Symmetry *sy = env->sym;
+    if (!sy) return s*ACTIONS + a;
+    return sym_row(sy, s)*ACTIONS + sy->perm[sy->t[s]][a];
+}
+
+static inline uint64_t rng_next(Rng *r){
+    uint64_t z = (r->s += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+static inline float rng_float(Rng *r){ return (float)(rng_next(r) >> 40) * (1.0f/16777216.0f); }
+static inline int rng_int(Rng *r, int n){ return (int)(((rng_next(r) >> 32) * (uint64_t)n) >> 32); }
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Reusable barrier (pthread_barrier_t is missing on macOS).
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int n, count;
+    unsigned phase;
+} Barrier;
+
+static void barrier_init(Barrier *b, int n){
+    pthread_mutex_init(&b->mu, NULL);
+    pthread_cond_init(&b->cv, NULL);
+    b->n = n; b->count = 0; b->phase = 0;
+}
+
+static void barrier_destroy(Barrier *b){
+    pthread_mutex_destroy(&b->mu);
+    pthread_cond_destroy(&b->cv);
+}
+
+static void barrier_wait(Barrier *b){
+    if (b->n <= 1) return;
+    pthread_mutex_lock(&b->mu);
+    unsigned phase = b->phase;
+    if (++b->count == b->n){
+        b->count = 0;
+        b->phase++;
+        pthread_cond_broadcast(&b->cv);
+    } else {
+        while (phase == b->phase) pthread_cond_wait(&b->cv, &b->mu);
+    }
+    pthread_mutex_unlock(&b->mu);
+}
+
+void env_init(Env *env, int w, int h) {
+    env->w = w; env->h = h;
+    env->sym = NULL;
+    env->start_x = 0; env->start_y = 0;
+    env->goal_x = w-1; env->goal_y = h-1;
+    env->walls = (unsigned char*)calloc((size_t)w*(size_t)h, 1);
+    if (!env->walls) { fprintf(stderr, "OOM\n"); exit(1); }
+    // Example obstacles for a small maze; tweak as you like
+    if (w>=5 && h>=5) {
+        env->walls[1*w+2] = 1;
+        env->walls[2*w+2] = 1;
+        env->walls[3*w+2] = 1;
+        env->walls[3*w+1] = 1;
+    }
+    env->step_limit = w*h*4;
+    env->step_reward = -1.0f;
+    env->goal_reward = 10.0f;
+}
+
+void env_free(Env *env){
+    free(env->walls); env->walls=NULL;
+}
+
+// Load a map drawn with the render() symbols: '#' wall, '.' free, 'S' start,
+// 'G' goal. Spaces are ignored, so render() output can be fed back in.
+int env_load_map(Env *env, const char *path){
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char *line = NULL; size_t cap = 0; ssize_t len;
+    unsigned char *cells = NULL; size_t ncells = 0, cells_cap = 0;
+    int w = -1, h = 0, sx = -1, sy = -1, gx = -1, gy = -1, ok = 1;
+    while (ok && (len = getline(&line, &cap, f)) != -1){
+        int x = 0;
+        for (ssize_t i=0; i<len; ++i){
+            char c = line[i];
+            if (c==' ' || c=='\t' || c=='\r' || c=='\n') continue;
+            if (c!='#' && c!='.' && c!='S' && c!='G'){ ok = 0; break; }
+            if (ncells == cells_cap){
+                cells_cap = cells_cap ? cells_cap*2 : 4096;
+                unsigned char *nc = (unsigned char*)realloc(cells, cells_cap);
+                if (!nc){ ok = 0; break; }
+                cells = nc;
+            }
+            cells[ncells++] = (unsigned char)(c=='#');
+            if (c=='S'){ sx = x; sy = h; }
+            if (c=='G'){ gx = x; gy = h; }
+            x++;
+        }
+        if (!ok || x==0) continue;   // blank lines are skipped
+        if (w<0) w = x;
+        if (x!=w) ok = 0;
+        h++;
+    }
+    free(line);
+    fclose(f);
+    if (!ok || w<2 || h<2 || w>MAX_W || h>MAX_H || sx<0 || gx<0){
+        free(cells);
+        return 0;
+    }
+    env_init(env, w, h);
+    memcpy(env->walls, cells, (size_t)w*(size_t)h);
+    free(cells);
+    env->start_x = sx; env->start_y = sy;
+    env->goal_x = gx; env->goal_y = gy;
+    return 1;
+}
+
+int env_valid(const Env *env, int x, int y){
+    if (x<0 || x>=env->w || y<0 || y>=env->h) return 0;
+    if (env->walls[y*env->w + x]) return 0;
+    return 1;
+}
+
+Pos env_step(const Env *env, Pos s, int action, float *reward, int *done){
+    Pos ns = s;
+    if (action==0) ns.y -= 1;
+    else if (action==1) ns.x += 1;
+    else if (action==2) ns.y += 1;
+    else if (action==3) ns.x -= 1;
+
+    if (!env_valid(env, ns.x, ns.y)) {
+        // bump into wall/bounds: stay put, small penalty from step_reward
+        ns = s;
+    }
+    *done = (ns.x==env->goal_x && ns.y==env->goal_y);
+    *reward = *done ? env->goal_reward : env->step_reward;
+    return ns;
+}
+
+// All free, non-goal cells as state ids. Caller frees *out.
+int env_free_cells(const Env *env, int **out){
+    int S = env->w * env->h, n = 0;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    int *cells = (int*)malloc(sizeof(int) * (size_t)S);
+    if (!cells){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int s=0; s<S; ++s){
+        if (!env->walls[s] && s!=goal) cells[n++] = s;
+    }
+    *out = cells;
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Symmetry reduction. Of the 8 reflections/rotations of a square map (4 of a
+// rectangular one), keep those that map every wall onto a wall and the goal
+// onto itself; Q*(s,a) = Q*(g(s), g(a)) for each of them. A state's canonical
+// image is the one with the smallest (x, y). Q then needs one row per
+// canonical state: half the table for one mirror, a quarter for two, an
+// eighth for the full group.
+// ---------------------------------------------------------------------------
+
+static const char *sym_names[8] = { "identity", "transpose", "flip-x", "rot90",
+                                    "flip-y", "rot270", "rot180", "anti-transpose" };
+
+// Returns 1 and fills sy if anything beyond the identity preserves the map.
+int symmetry_detect(Symmetry *sy, const Env *env){
+    int w = env->w, h = env->h, S = w * h;
+    memset(sy, 0, sizeof(*sy));
+    sy->w = w; sy->h = h;
+    sy->inv_w = ((1ull << 46) + (uint64_t)w - 1) / (uint64_t)w;
+    for (int k=0; k<8; ++k){
+        if ((k & SYM_SWAP) && w != h) continue;
+        // Transpose first, then flip
+        int m[6] = { 1, 0, 0, 0, 1, 0 };
+        if (k & SYM_SWAP){ m[0] = 0; m[1] = 1; m[3] = 1; m[4] = 0; }
+        if (k & SYM_FLIP_X){ m[0] = -m[0]; m[1] = -m[1]; m[2] = w-1; }
+        if (k & SYM_FLIP_Y){ m[3] = -m[3]; m[4] = -m[4]; m[5] = h-1; }
+        int gx = m[0]*env->goal_x + m[1]*env->goal_y + m[2];
+        int gy = m[3]*env->goal_x + m[4]*env->goal_y + m[5];
+        int ok = gx == env->goal_x && gy == env->goal_y;
+        for (int s=0; s<S && ok; ++s){
+            int x = s % w, y = s / w;
+            ok = env->walls[s] == env->walls[(m[3]*x + m[4]*y + m[5])*w + m[0]*x + m[1]*y + m[2]];
+        }
+        if (!ok) continue;
+        int i = sy->n++;
+        sy->k[i] = k;
+        memcpy(sy->m[i], m, sizeof(m));
+        for (int a=0; a<ACTIONS; ++a){
+            // Actions transform like the (dx,dy) they move by
+            static const int dx[ACTIONS] = { 0, 1, 0, -1 }, dy[ACTIONS] = { -1, 0, 1, 0 };
+            int tx = m[0]*dx[a] + m[1]*dy[a], ty = m[3]*dx[a] + m[4]*dy[a];
+            for (int b=0; b<ACTIONS; ++b) if (dx[b] == tx && dy[b] == ty) sy->perm[i][a] = (unsigned char)b;
+        }
+    }
+    if (sy->n <= 1) return 0;
+
+    sy->t = (unsigned char*)malloc((size_t)S);
+    sy->row = (int*)calloc((size_t)h + 1, sizeof(int));
+    if (!sy->t || !sy->row){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int s=0; s<S; ++s){
+        int x = s % w, y = s / w, best = 0, bx = x, by = y;
+        for (int i=1; i<sy->n; ++i){
+            const int *m = sy->m[i];
+            int cx = m[0]*x + m[1]*y + m[2], cy = m[3]*x + m[4]*y + m[5];
+            if (cx < bx || (cx == bx && cy < by)){ best = i; bx = cx; by = cy; }
+        }
+        sy->t[s] = (unsigned char)best;
+        if (best == 0) sy->row[y+1]++;
+    }
+    for (int y=0; y<h; ++y){
+        // Canonical cells of a row must be a prefix for row[y] + x to be dense
+        for (int x=0; x<w; ++x){
+            if ((sy->t[y*w + x] == 0) != (x < sy->row[y+1])){
+                fprintf(stderr, "Symmetry: canonical cells of row %d are not a prefix\n", y);
+                free(sy->t); free(sy->row);
+                sy->t = NULL; sy->row = NULL;
+                return 0;
+            }
+        }
+        sy->row[y+1] += sy->row[y];
+    }
+    sy->count = sy->row[h];
+    return 1;
+}
+
+void symmetry_free(Symmetry *sy){
+    free(sy->t); free(sy->row);
+    sy->t = NULL; sy->row = NULL;
+}
+
+void symmetry_print(const Symmetry *sy){
+    printf("Symmetry: %d transforms (", sy->n);
+    for (int i=1; i<sy->n; ++i) printf("%s%s", i > 1 ? ", " : "", sym_names[sy->k[i]]);
+    printf("), %d canonical of %d states (%.1f%%)\n", sy->count, sy->w * sy->h,
+           100.0 * sy->count / ((double)sy->w * sy->h));
+}
+
+// Zeroed table of `rows` states. Line-aligned so that a cache line never
+// straddles two shards; tables of HUGE_PAGE or more are backed by huge pages
+// where available, which also keeps fork() (checkpoints) from copying
+// hundreds of thousands of page-table entries.
+static void qmodel_alloc_rows(QModel *m, int w, int h, size_t rows){
+    m->w = w; m->h = h;
+    m->map = NULL; m->map_bytes = 0;
+    size_t bytes = rows * ACTIONS * sizeof(float), align = CACHE_LINE;
+    if (bytes >= HUGE_PAGE) align = HUGE_PAGE;
+    bytes = (bytes + align-1) / align * align;
+    m->q = (float*)aligned_alloc(align, bytes);
+    if (!m->q) { fprintf(stderr, "OOM\n"); exit(1); }
+#ifdef MADV_HUGEPAGE
+    if (align == HUGE_PAGE) madvise(m->q, bytes, MADV_HUGEPAGE);
+#endif
+    memset(m->q, 0, bytes);
+}
+
+void qmodel_alloc(QModel *m, int w, int h) {
+    qmodel_alloc_rows(m, w, h, (size_t)w * h);
+}
+
+// Rows for env's states: the canonical ones only when env->sym is set.
+void qmodel_alloc_env(QModel *m, const Env *env){
+    qmodel_alloc_rows(m, env->w, env->h, env->sym ? (size_t)env->sym->count : (size_t)env->w * env->h);
+}
+
+// Full per-state table from a symmetry-reduced one (for --save).
+void qmodel_unfold(const QModel *src, const Env *env, QModel *dst){
+    qmodel_alloc(dst, env->w, env->h);
+    for (int s=0; s<env->w*env->h; ++s)
+        for (int a=0; a<ACTIONS; ++a) dst->q[s*ACTIONS + a] = src->q[idxQ(env, s, a)];
+}
+
+void qmodel_free(QModel *m) {
+    if (m->map) munmap(m->map, m->map_bytes);
+    else free(m->q);
+    m->q=NULL; m->map=NULL;
+}
+
+int argmax_a(const QModel *m, const Env *env, int s) {
+    if (env->sym){
+        // Locate the canonical row once rather than per action
+        const float *row = &m->q[sym_row(env->sym, s)*ACTIONS];
+        const unsigned char *perm = env->sym->perm[env->sym->t[s]];
+        int best_a = 0;
+        for (int a=1; a<ACTIONS; ++a) if (row[perm[a]] > row[perm[best_a]]) best_a = a;
+        return best_a;
+    }
+    float best = m->q[idxQ(env, s, 0)];
+    int best_a = 0;
+    for (int a=1; a<ACTIONS; ++a){
+        float v = m->q[idxQ(env, s, a)];
+        if (v > best){ best=v; best_a=a; }
+    }
+    return best_a;
+}
+
+float maxQ(const QModel *m, const Env *env, int s){
+    if (env->sym){
+        const float *row = &m->q[sym_row(env->sym, s)*ACTIONS];
+        return fmaxf(fmaxf(row[0], row[1]), fmaxf(row[2], row[3]));
+    }
+    float best = m->q[idxQ(env,s,0)];
+    for (int a=1; a<ACTIONS; ++a){
+        float v = m->q[idxQ(env,s,a)];
+        if (v>best) best=v;
+    }
+    return best;
+}
+
+int eps_greedy_action_r(const QModel *m, const Env *env, int s, float eps, Rng *rng){
+    if (rng_float(rng) < eps) return rng_int(rng, ACTIONS);
+    return argmax_a(m, env, s);
+}
+
+// ---------------------------------------------------------------------------
+// Q-table files. A 128-byte header (QtHeader) is followed by the table at a
+// 64-byte-aligned offset:
+//   q[((y*w + x) * ACTIONS + a], float32, a = up,right,down,left
+// Values are stored in the writer's byte order; `endian` tells a reader on
+// the other order to swap. Both the header and the payload carry a CRC-32.
+// A little-endian file can be mmap'd and used in place (load_qtable with
+// use_mmap), which skips the payload CRC. Files without the magic are read
+// as the original headerless format: int w, int h, float[w*h*ACTIONS].
+// An optional training-state block (state_bytes, with its own CRC) follows
+// the payload, so that --load can resume training exactly. It is opaque to
+// this layer and stays in the writer's byte order.
+// ---------------------------------------------------------------------------
+
+#define QT_MAGIC       "QGRIDQT"
+#define QT_VERSION     1
+#define QT_ENDIAN      0x01020304u
+#define QT_DTYPE_F32   1
+#define QT_LAYOUT_SA   1   // state-major, row-major states, ACTIONS per state
+#define QT_ALIGN       64
+#define QT_MMAP        1   // load_qtable use_mmap: map, payload unchecked
+#define QT_MMAP_VERIFY 2   // map and check the payload CRC
+
+typedef struct {
+    char magic[8];          // QT_MAGIC, NUL-padded
+    uint32_t version;       // QT_VERSION
+    uint32_t endian;        // QT_ENDIAN as written by the writer
+    uint32_t header_bytes;  // payload offset, multiple of QT_ALIGN
+    uint32_t dtype;         // QT_DTYPE_F32
+    uint32_t layout;        // QT_LAYOUT_SA
+    uint32_t actions;       // ACTIONS
+    int32_t w, h;
+    uint64_t payload_bytes;
+    uint32_t payload_crc;
+    uint32_t reserved0;
+    // Hyperparameters the table was trained with (informational, 0 if unknown)
+    float alpha, gamma, eps_start, eps_min, eps_decay;
+    float step_reward, goal_reward;
+    uint32_t reserved1;
+    int64_t episodes;
+    uint64_t state_bytes;   // training state after the payload, 0 if none
+    uint32_t state_crc;
+    uint8_t reserved[16];
+    uint32_t header_crc;    // CRC-32 of this header with header_crc = 0
+} QtHeader;
+
+_Static_assert(sizeof(QtHeader) == 128, "QtHeader must stay 128 bytes");
+_Static_assert(sizeof(QtHeader) % QT_ALIGN == 0, "payload must start 64-byte aligned");
+
+// Training settings recorded in (and read back from) the header
+typedef struct {
+    float alpha, gamma, eps_start, eps_min, eps_decay;
+    float step_reward, goal_reward;
+    long long episodes;
+    void *state;            // load: training-state block (caller frees), NULL if none
+    size_t state_bytes;
+} QtMeta;
+
+// A piece of the training-state block, written in order after the payload
+typedef struct {
+    const void *p;
+    size_t bytes;
+} QtChunk;
+
+// Slicing-by-8: table k advances a byte's contribution by k further bytes
+static uint32_t crc32_table[8][256];
+
+static void crc32_init(void){
+    if (crc32_table[0][1]) return;
+    for (uint32_t i=0; i<256; ++i){
+        uint32_t c = i;
+        for (int k=0; k<8; ++k) c = (c >> 1) ^ (0xEDB88320u & -(c & 1u));
+        crc32_table[0][i] = c;
+    }
+    for (int k=1; k<8; ++k)
+        for (int i=0; i<256; ++i)
+            crc32_table[k][i] = (crc32_table[k-1][i] >> 8) ^ crc32_table[0][crc32_table[k-1][i] & 0xFF];
+}
+
+// CRC-32 (IEEE, as zlib), continued from `crc` (0 to start)
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n){
+    crc32_init();
+    const unsigned char *p = (const unsigned char*)data;
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8){
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF]
+            ^ crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24]
+            ^ crc32_table[3][p[4]] ^ crc32_table[2][p[5]]
+            ^ crc32_table[1][p[6]] ^ crc32_table[0][p[7]];
+    }
+    for (; n; --n) crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t bswap32(uint32_t v){
+    return (v >> 24) | ((v >> 8) & 0xFF00u) | ((v << 8) & 0xFF0000u) | (v << 24);
+}
+
+static uint64_t bswap64(uint64_t v){
+    return ((uint64_t)bswap32((uint32_t)v) << 32) | bswap32((uint32_t)(v >> 32));
+}
+
+// Swaps every 4- and 8-byte field of a header written on the other byte order
+static void qt_header_swap(QtHeader *hd){
+    uint32_t *u = &hd->version;
+    for (uint32_t *e = (uint32_t*)&hd->payload_bytes; u < e; ++u) *u = bswap32(*u);
+    hd->payload_bytes = bswap64(hd->payload_bytes);
+    for (u = &hd->payload_crc; u <= &hd->reserved1; ++u) *u = bswap32(*u);
+    hd->episodes = (int64_t)bswap64((uint64_t)hd->episodes);
+    hd->state_bytes = bswap64(hd->state_bytes);
+    hd->state_crc = bswap32(hd->state_crc);
+    hd->header_crc = bswap32(hd->header_crc);
+}
+
+static uint32_t qt_header_crc(const QtHeader *hd){
+    QtHeader c = *hd;
+    c.header_crc = 0;
+    return crc32_update(0, &c, sizeof(c));
+}
+
+// Writes m (full layout, no symmetry reduction) with meta, which may be NULL,
+// and the nstate chunks of training state. The file is written as PATH.tmp,
+// synced and renamed over PATH, so readers and crashes see either the old
+// table or the new one.
+int save_qtable_state(const char *path, const QModel *m, const QtMeta *meta,
+                      const QtChunk *state, int nstate){
+    size_t plen = strlen(path);
+    char *tmp = (char*)malloc(plen + 5);
+    if (!tmp){ fprintf(stderr, "OOM\n"); exit(1); }
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    if (!f){ perror(tmp); free(tmp); return 0; }
+    size_t n = (size_t)m->w * m->h * ACTIONS;
+    QtHeader hd;
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, QT_MAGIC, sizeof(QT_MAGIC));
+    hd.version = QT_VERSION;
+    hd.endian = QT_ENDIAN;
+    hd.header_bytes = sizeof(QtHeader);
+    hd.dtype = QT_DTYPE_F32;
+    hd.layout = QT_LAYOUT_SA;
+    hd.actions = ACTIONS;
+    hd.w = m->w; hd.h = m->h;
+    hd.payload_bytes = n * sizeof(float);
+    hd.payload_crc = crc32_update(0, m->q, n * sizeof(float));
+    if (meta){
+        hd.alpha = meta->alpha; hd.gamma = meta->gamma;
+        hd.eps_start = meta->eps_start; hd.eps_min = meta->eps_min; hd.eps_decay = meta->eps_decay;
+        hd.step_reward = meta->step_reward; hd.goal_reward = meta->goal_reward;
+        hd.episodes = meta->episodes;
+    }
+    for (int i=0; i<nstate; ++i){
+        hd.state_bytes += state[i].bytes;
+        hd.state_crc = crc32_update(hd.state_crc, state[i].p, state[i].bytes);
+    }
+    hd.header_crc = qt_header_crc(&hd);
+    int ok = fwrite(&hd, sizeof(hd), 1, f) == 1 && fwrite(m->q, sizeof(float), n, f) == n;
+    for (int i=0; ok && i<nstate; ++i)
+        ok = state[i].bytes == 0 || fwrite(state[i].p, state[i].bytes, 1, f) == 1;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0){ perror("rename"); ok = 0; }
+    if (!ok){
+        fprintf(stderr, "Failed writing Q-table to %s\n", path);
+        remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+int save_qtable(const char *path, const QModel *m, const QtMeta *meta){
+    return save_qtable_state(path, m, meta, NULL, 0);
+}
+
+// Reads the training-state block of a checked header into meta, if any.
+// A bad block only costs the resume, not the table.
+static void qt_read_state(FILE *f, const char *path, const QtHeader *hd, int swap, QtMeta *meta){
+    if (!meta || hd->state_bytes == 0) return;
+    void *st = swap || hd->state_bytes > SIZE_MAX / 2 ? NULL : malloc((size_t)hd->state_bytes);
+    if (st && fseek(f, (long)(hd->header_bytes + hd->payload_bytes), SEEK_SET) == 0
+        && fread(st, (size_t)hd->state_bytes, 1, f) == 1
+        && crc32_update(0, st, (size_t)hd->state_bytes) == hd->state_crc){
+        meta->state = st;
+        meta->state_bytes = (size_t)hd->state_bytes;
+        return;
+    }
+    fprintf(stderr, "%s: training state %s, not resuming it\n", path,
+            swap ? "is in the other byte order" : "truncated or CRC mismatch");
+    free(st);
+}
+
+// Original headerless format: int w, int h, float[w*h*ACTIONS]
+static int load_qtable_legacy(FILE *f, const char *path, QModel *m){
+    int w, h;
+    if (fseek(f, 0, SEEK_SET) != 0
+        || fread(&w,sizeof(int),1,f)!=1 || fread(&h,sizeof(int),1,f)!=1
+        || w<1 || h<1 || w>MAX_W || h>MAX_H){
+        fprintf(stderr, "%s: not a Q-table\n", path);
+        return 0;
+    }
+    qmodel_alloc(m, w, h);
+    size_t n = (size_t)w * h * ACTIONS;
+    if (fread(m->q, sizeof(float), n, f)!=n){
+        fprintf(stderr, "%s: truncated (headerless format)\n", path);
+        qmodel_free(m);
+        return 0;
+    }
+    return 1;
+}
+
+// Loads a Q-table. With use_mmap, a little-endian versioned file is mapped
+// copy-on-write instead of read: no copy, and no payload CRC pass unless
+// use_mmap is QT_MMAP_VERIFY (which reads every page once). meta (may
+// be NULL) receives the header's hyperparameters, zeroed for old files, and
+// the training-state block if there is one in this byte order.
+int load_qtable(const char *path, QModel *m, int use_mmap, QtMeta *meta){
+    FILE *f = fopen(path, "rb");
+    if (!f){ perror(path); return 0; }
+    if (meta) memset(meta, 0, sizeof(*meta));
+    QtHeader hd;
+    if (fread(&hd, sizeof(hd), 1, f) != 1 || memcmp(hd.magic, QT_MAGIC, sizeof(QT_MAGIC)) != 0){
+        int ok = load_qtable_legacy(f, path, m);
+        fclose(f);
+        return ok;
+    }
+    int swap = hd.endian == bswap32(QT_ENDIAN);
+    // The CRC covers the header as written, so check it before swapping
+    int crc_ok = qt_header_crc(&hd) == (swap ? bswap32(hd.header_crc) : hd.header_crc);
+    if (swap) qt_header_swap(&hd);
+    size_t n = (size_t)(hd.w > 0 ? hd.w : 0) * (size_t)(hd.h > 0 ? hd.h : 0) * ACTIONS;
+    const char *err = hd.endian != QT_ENDIAN ? "unknown byte order"
+                    : !crc_ok ? "header CRC mismatch"
+                    : hd.version != QT_VERSION ? "unsupported version"
+                    : hd.dtype != QT_DTYPE_F32 || hd.layout != QT_LAYOUT_SA || hd.actions != ACTIONS
+                      ? "unsupported dtype/layout"
+                    : hd.w < 1 || hd.h < 1 || hd.w > MAX_W || hd.h > MAX_H ? "bad dimensions"
+                    : hd.payload_bytes != n * sizeof(float) || hd.header_bytes % QT_ALIGN
+                      || hd.header_bytes < sizeof(QtHeader) ? "bad payload size/offset"
+                    : NULL;
+    if (err){
+        fprintf(stderr, "%s: %s\n", path, err);
+        fclose(f);
+        return 0;
+    }
+    if (meta){
+        meta->alpha = hd.alpha; meta->gamma = hd.gamma;
+        meta->eps_start = hd.eps_start; meta->eps_min = hd.eps_min; meta->eps_decay = hd.eps_decay;
+        meta->step_reward = hd.step_reward; meta->goal_reward = hd.goal_reward;
+        meta->episodes = hd.episodes;
+    }
+    if (use_mmap && !swap){
+        struct stat st;
+        size_t bytes = (size_t)hd.header_bytes + hd.payload_bytes;
+        if (fstat(fileno(f), &st) != 0 || (size_t)st.st_size < bytes){
+            fprintf(stderr, "%s: truncated\n", path);
+            fclose(f);
+            return 0;
+        }
+        void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+        if (p == MAP_FAILED){ perror("mmap"); fclose(f); return 0; }
+        qt_read_state(f, path, &hd, 0, meta);
+        fclose(f);
+        m->w = hd.w; m->h = hd.h;
+        m->map = p; m->map_bytes = bytes;
+        m->q = (float*)((char*)p + hd.header_bytes);
+        if (use_mmap == QT_MMAP_VERIFY && crc32_update(0, m->q, n * sizeof(float)) != hd.payload_crc){
+            fprintf(stderr, "%s: payload CRC mismatch\n", path);
+            qmodel_free(m);
+            if (meta){ free(meta->state); meta->state = NULL; meta->state_bytes = 0; }
+            return 0;
+        }
+        return 1;
+    }
+    qmodel_alloc(m, hd.w, hd.h);
+    if (fseek(f, (long)hd.header_bytes, SEEK_SET) != 0 || fread(m->q, sizeof(float), n, f) != n){
+        fprintf(stderr, "%s: truncated\n", path);
+        qmodel_free(m);
+        fclose(f);
+        return 0;
+    }
+    qt_read_state(f, path, &hd, swap, meta);
+    fclose(f);
+    if (crc32_update(0, m->q, n * sizeof(float)) != hd.payload_crc){
+        fprintf(stderr, "%s: payload CRC mismatch\n", path);
+        qmodel_free(m);
+        if (meta){ free(meta->state); meta->state = NULL; meta->state_bytes = 0; }
+        return 0;
+    }
+    if (swap){
+        uint32_t *u = (uint32_t*)m->q;
+        for (size_t i=0; i<n; ++i) u[i] = bswap32(u[i]);
+    }
+    return 1;
+}
+
+void render(const Env *env, Pos agent){
+    for (int y=0; y<env->h; ++y){
+        for (int x=0; x<env->w; ++x){
+            char c='.';
+            if (env->walls[y*env->w + x]) c='#';
+            if (x==env->goal_x && y==env->goal_y) c='G';
+            if (x==agent.x && y==agent.y) c='A';
+            if (x==env->start_x && y==env->start_y) c = (c=='A')?'A':'S';
+            printf("%c ", c);
+        }
+        printf("\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Distance oracle: with a constant step penalty and a goal bonus the optimal
+// policy is a shortest path, so exact BFS distances decide optimality.
+// ---------------------------------------------------------------------------
+
+// Multi-source BFS over free cells. dist[s] = moves from s to the nearest
+// source, -1 if unreachable (walls included). Moves are symmetric, so the
+// search runs outward from the sources. A visited bitset keeps the hot
+// membership test in a w*h/8-byte array.
+void bfs_distances(const Env *env, const int *sources, int nsrc, int *dist){
+    int S = env->w * env->h, w = env->w;
+    size_t words = ((size_t)S + 63) / 64;
+    uint64_t *seen = (uint64_t*)calloc(words, sizeof(uint64_t));
+    int *queue = (int*)malloc(sizeof(int) * (size_t)S);
+    if (!seen || !queue){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int s=0; s<S; ++s){
+        dist[s] = -1;
+        if (env->walls[s]) seen[s>>6] |= 1ull << (s & 63);
+    }
+    int head = 0, tail = 0;
+    for (int i=0; i<nsrc; ++i){
+        int s = sources[i];
+        if (seen[s>>6] >> (s & 63) & 1) continue;
+        seen[s>>6] |= 1ull << (s & 63);
+        dist[s] = 0;
+        queue[tail++] = s;
+    }
+    while (head < tail){
+        int s = queue[head++], x = s % w, y = s / w;
+        int nb[4] = { y>0 ? s-w : -1, x<w-1 ? s+1 : -1,
+                      y<env->h-1 ? s+w : -1, x>0 ? s-1 : -1 };
+        for (int k=0; k<4; ++k){
+            int n = nb[k];
+            if (n < 0 || (seen[n>>6] >> (n & 63) & 1)) continue;
+            seen[n>>6] |= 1ull << (n & 63);
+            dist[n] = dist[s] + 1;
+            queue[tail++] = n;
+        }
+    }
+    free(seen); free(queue);
+}
+
+// Bit-parallel wavefront BFS. The free mask, visited set and frontier are
+// bit-packed rows of 64-bit words; one BFS layer is
+//   next = (F<<1 | F>>1 | F[row-1] | F[row+1]) & free & ~visited
+// computed 64 cells per instruction, with threads on bands of rows. Each
+// thread keeps a list of its non-zero frontier words and only evaluates words
+// next to them, so a layer costs O(frontier words), not O(grid); rows on a
+// band edge are read from the neighbouring band. Same output as
+// bfs_distances(), but measured slower than it on one core and not measured
+// on several, so the queue BFS stays the default.
+typedef struct {
+    _Alignas(CACHE_LINE) int any[2];   // per layer parity
+} BwSlot;
+
+typedef struct {
+    const Env *env;
+    int *dist;
+    int wpr;                          // 64-bit words per row
+    uint64_t *freem, *vis, *buf[2];   // h*wpr each
+    int *stamp;                       // h*wpr: last layer a word was queued
+    int nthreads;
+    Barrier bar;
+    BwSlot *slots;
+} BwShared;
+
+typedef struct {
+    BwShared *sh;
+    int id, y0, y1;
+    size_t *list[2], *cand;           // word indices inside [y0, y1)
+    size_t len[2];
+} BwWorker;
+
+// Queue a word of this band once per layer, unless all its free cells are
+// already visited.
+static inline void bw_queue(BwWorker *wk, size_t *n, size_t word, int layer){
+    if (wk->sh->stamp[word] == layer || wk->sh->vis[word] == wk->sh->freem[word]) return;
+    wk->sh->stamp[word] = layer;
+    wk->cand[(*n)++] = word;
+}
+
+static void *bw_worker(void *arg){
+    BwWorker *wk = (BwWorker*)arg;
+    BwShared *sh = wk->sh;
+    int w = sh->env->w, h = sh->env->h, wpr = sh->wpr;
+    size_t lo = (size_t)wk->y0 * wpr, hi = (size_t)wk->y1 * wpr;
+    int cur = 0;
+    wk->len[0] = 0;
+    for (size_t i=lo; i<hi; ++i) if (sh->buf[0][i]) wk->list[0][wk->len[0]++] = i;
+    wk->len[1] = 0;
+    for (int layer=1;; ++layer){
+        const uint64_t *F = sh->buf[cur];
+        uint64_t *Fn = sh->buf[cur^1];
+        // Fn still holds layer-2 output; clear it and reuse its list
+        for (size_t i=0; i<wk->len[cur^1]; ++i) Fn[wk->list[cur^1][i]] = 0;
+        size_t nc = 0;
+        for (size_t i=0; i<wk->len[cur]; ++i){
+            size_t word = wk->list[cur][i];
+            size_t k = word % wpr;
+            uint64_t c = F[word];
+            bw_queue(wk, &nc, word, layer);
+            if (k>0 && (c & 1)) bw_queue(wk, &nc, word-1, layer);
+            if ((int)k<wpr-1 && (c >> 63)) bw_queue(wk, &nc, word+1, layer);
+            if (word >= lo + wpr) bw_queue(wk, &nc, word-wpr, layer);
+            if (word + wpr < hi) bw_queue(wk, &nc, word+wpr, layer);
+        }
+        if (wk->y0 > 0)
+            for (int k=0; k<wpr; ++k) if (F[lo - wpr + k]) bw_queue(wk, &nc, lo + k, layer);
+        if (wk->y1 < h)
+            for (int k=0; k<wpr; ++k) if (F[hi + k]) bw_queue(wk, &nc, hi - wpr + k, layer);
+        size_t *out = wk->list[cur^1], nout = 0;
+        for (size_t i=0; i<nc; ++i){
+            size_t word = wk->cand[i];
+            int y = (int)(word / wpr), k = (int)(word % wpr);
+            uint64_t c = F[word];
+            uint64_t nb = (c << 1) | (c >> 1);
+            if (k>0) nb |= F[word-1] >> 63;
+            if (k<wpr-1) nb |= F[word+1] << 63;
+            if (y>0) nb |= F[word-wpr];
+            if (y<h-1) nb |= F[word+wpr];
+            uint64_t n = nb & sh->freem[word] & ~sh->vis[word];
+            if (!n) continue;
+            Fn[word] = n;
+            sh->vis[word] |= n;
+            out[nout++] = word;
+            while (n){
+                int b = __builtin_ctzll(n);
+                sh->dist[(size_t)y*w + (size_t)k*64 + b] = layer;
+                n &= n - 1;
+            }
+        }
+        wk->len[cur^1] = nout;
+        sh->slots[wk->id].any[layer & 1] = nout != 0;
+        barrier_wait(&sh->bar);
+        int all = 0;
+        for (int t=0; t<sh->nthreads; ++t) all |= sh->slots[t].any[layer & 1];
+        if (!all) break;
+        cur ^= 1;
+    }
+    return NULL;
+}
+
+void bfs_distances_bitwave(const Env *env, const int *sources, int nsrc, int *dist, int threads){
+    int w = env->w, h = env->h;
+    BwShared sh;
+    sh.env = env; sh.dist = dist;
+    sh.wpr = (w + 63) / 64;
+    size_t words = (size_t)h * (size_t)sh.wpr;
+    sh.freem = (uint64_t*)calloc(words, sizeof(uint64_t));
+    sh.vis = (uint64_t*)calloc(words, sizeof(uint64_t));
+    sh.buf[0] = (uint64_t*)calloc(words, sizeof(uint64_t));
+    sh.buf[1] = (uint64_t*)calloc(words, sizeof(uint64_t));
+    sh.stamp = (int*)calloc(words, sizeof(int));
+    if (!sh.freem || !sh.vis || !sh.buf[0] || !sh.buf[1] || !sh.stamp){
+        fprintf(stderr, "OOM\n"); exit(1);
+    }
+    for (int y=0; y<h; ++y){
+        for (int x=0; x<w; ++x){
+            size_t s = (size_t)y*w + x;
+            dist[s] = -1;
+            if (!env->walls[s]) sh.freem[(size_t)y*sh.wpr + x/64] |= 1ull << (x & 63);
+        }
+    }
+    for (int i=0; i<nsrc; ++i){
+        int x = sources[i] % w, y = sources[i] / w;
+        size_t k = (size_t)y*sh.wpr + x/64;
+        uint64_t bit = 1ull << (x & 63);
+        if (!(sh.freem[k] & bit)) continue;
+        sh.buf[0][k] |= bit;
+        sh.vis[k] |= bit;
+        dist[sources[i]] = 0;
+    }
+    if (threads > h) threads = h;
+    if (threads < 1) threads = 1;
+    sh.nthreads = threads;
+    barrier_init(&sh.bar, threads);
+    sh.slots = (BwSlot*)aligned_alloc(CACHE_LINE, sizeof(BwSlot) * (size_t)threads);
+    BwWorker *wk = (BwWorker*)malloc(sizeof(BwWorker) * (size_t)threads);
+    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)threads);
+    if (!sh.slots || !wk || !tids){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int t=0; t<threads; ++t){
+        wk[t].sh = &sh; wk[t].id = t;
+        wk[t].y0 = (int)((long long)h * t / threads);
+        wk[t].y1 = (int)((long long)h * (t+1) / threads);
+        size_t band = (size_t)(wk[t].y1 - wk[t].y0) * (size_t)sh.wpr;
+        wk[t].list[0] = (size_t*)malloc(sizeof(size_t) * band);
+        wk[t].list[1] = (size_t*)malloc(sizeof(size_t) * band);
+        wk[t].cand = (size_t*)malloc(sizeof(size_t) * band);
+        if (!wk[t].list[0] || !wk[t].list[1] || !wk[t].cand){ fprintf(stderr, "OOM\n"); exit(1); }
+    }
+    for (int t=1; t<threads; ++t){
+        if (pthread_create(&tids[t], NULL, bw_worker, &wk[t]) != 0){
+            fprintf(stderr, "pthread_create failed\n"); exit(1);
+        }
+    }
+    bw_worker(&wk[0]);
+    for (int t=1; t<threads; ++t) pthread_join(tids[t], NULL);
+    barrier_destroy(&sh.bar);
+    for (int t=0; t<threads; ++t){ free(wk[t].list[0]); free(wk[t].list[1]); free(wk[t].cand); }
+    free(sh.freem); free(sh.vis); free(sh.buf[0]); free(sh.buf[1]); free(sh.stamp);
+    free(sh.slots); free(wk); free(tids);
+}
+
+// bit_threads > 0 selects the bit-parallel wavefront with that many threads.
+void env_goal_distances(const Env *env, int *dist, int bit_threads){
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    if (bit_threads > 0) bfs_distances_bitwave(env, &goal, 1, dist, bit_threads);
+    else bfs_distances(env, &goal, 1, dist);
+}
+
+void bench_bfs(const Env *env, int max_threads){
+    size_t S = (size_t)env->w * (size_t)env->h;
+    int *d0 = (int*)malloc(sizeof(int) * S), *d1 = (int*)malloc(sizeof(int) * S);
+    if (!d0 || !d1){ fprintf(stderr, "OOM\n"); exit(1); }
+    printf("Goal distance field on %dx%d\n", env->w, env->h);
+    double t0 = now_sec();
+    env_goal_distances(env, d0, 0);
+    printf("  queue BFS          %8.3fs\n", now_sec() - t0);
+    for (int t=1;; t = t*2 < max_threads ? t*2 : max_threads){
+        t0 = now_sec();
+        env_goal_distances(env, d1, t);
+        double dt = now_sec() - t0;
+        printf("  bitwave %3d thr    %8.3fs  %s\n", t, dt,
+               memcmp(d0, d1, sizeof(int) * S) ? "MISMATCH" : "match");
+        if (t >= max_threads) break;
+    }
+    free(d0); free(d1);
+}
+
+// Number of reachable non-goal states whose greedy move does not shorten the
+// distance to the goal by one; 0 means the greedy policy is optimal everywhere.
+long long policy_suboptimal_states(const Env *env, const QModel *m, const int *dist){
+    long long bad = 0;
+    for (int s=0; s<env->w*env->h; ++s){
+        if (dist[s] <= 0) continue;
+        float r; int done;
+        Pos p = env_step(env, (Pos){ s % env->w, s / env->w }, argmax_a(m, env, s), &r, &done);
+        if (dist[state_id(env, p.x, p.y)] != dist[s] - 1) bad++;
+    }
+    return bad;
+}
+
+// Greedy walk from the start reaches the goal in exactly dist[start] moves.
+int policy_optimal_from_start(const Env *env, const QModel *m, const int *dist){
+    Pos s = (Pos){ env->start_x, env->start_y };
+    int d = dist[state_id(env, s.x, s.y)];
+    if (d < 0) return 0;
+    for (int k=0; k<d; ++k){
+        float r; int done;
+        s = env_step(env, s, argmax_a(m, env, state_id(env, s.x, s.y)), &r, &done);
+        if (done) return k+1 == d;
+    }
+    return d == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Exploring starts: where each training episode begins
+// ---------------------------------------------------------------------------
+
+#define START_FIXED   0   // (start_x, start_y)
+#define START_UNIFORM 1   // any free cell that can reach the goal
+#define START_REVERSE 2   // reverse curriculum: radius around the goal grows
+#define START_VISITS  3   // favour rarely visited cells
+
+// Candidate cells in an array sorted by goal distance. A uniform draw is one
+// index, and the reverse curriculum draws from a prefix of the array.
+typedef struct {
+    int mode;
+    int *cells, ncells;     // reachable free non-goal cells, by goal distance
+    int *upto;              // [d] = number of cells with distance <= d
+    int max_dist;
+    int ramp;               // reverse: episodes until the whole map is open
+    unsigned *visits;       // visits: per-state visit counts
+    long long total_visits;
+} StartSampler;
+
+void starts_init(StartSampler *ss, const Env *env, int mode, const int *dist, int ramp){
+    memset(ss, 0, sizeof(*ss));
+    ss->mode = mode;
+    ss->ramp = ramp > 0 ? ramp : 1;
+    if (mode == START_FIXED) return;
+    int S = env->w * env->h;
+    int *own = NULL;
+    if (!dist){
+        own = (int*)malloc(sizeof(int) * (size_t)S);
+        if (!own){ fprintf(stderr, "OOM\n"); exit(1); }
+        env_goal_distances(env, own, 0);
+        dist = own;
+    }
+    for (int s=0; s<S; ++s) if (dist[s] > ss->max_dist) ss->max_dist = dist[s];
+    ss->upto = (int*)calloc((size_t)ss->max_dist + 2, sizeof(int));
+    ss->cells = (int*)malloc(sizeof(int) * (size_t)S);
+    if (!ss->upto || !ss->cells){ fprintf(stderr, "OOM\n"); exit(1); }
+    // Counting sort by distance; unreachable cells (dist < 0) and the goal are dropped
+    for (int s=0; s<S; ++s) if (dist[s] > 0) ss->upto[dist[s] + 1]++;
+    for (int d=0; d<=ss->max_dist; ++d) ss->upto[d+1] += ss->upto[d];
+    for (int s=0; s<S; ++s) if (dist[s] > 0) ss->cells[ss->upto[dist[s]]++] = s;
+    // upto[d] now counts cells with distance <= d
+    ss->ncells = ss->max_dist > 0 ? ss->upto[ss->max_dist] : 0;
+    if (mode == START_VISITS){
+        ss->visits = (unsigned*)calloc((size_t)S, sizeof(unsigned));
+        if (!ss->visits){ fprintf(stderr, "OOM\n"); exit(1); }
+    }
+    free(own);
+}
+
+void starts_free(StartSampler *ss){
+    free(ss->cells); free(ss->upto); free(ss->visits);
+    ss->cells = NULL; ss->upto = NULL; ss->visits = NULL;
+}
+
+// Start state for episode ep. Visit weighting is rejection sampling: a uniform
+// candidate with v visits is accepted with probability 1/(1 + v/mean), so
+// about two draws are needed per start whatever the spread of counts.
+static int starts_sample(const StartSampler *ss, const Env *env, int ep, Rng *rng){
+    if (ss->mode == START_FIXED || ss->ncells == 0)
+        return state_id(env, env->start_x, env->start_y);
+    if (ss->mode == START_REVERSE){
+        long long e = ep < ss->ramp ? ep : ss->ramp;
+        int radius = 1 + (int)((long long)(ss->max_dist - 1) * e / ss->ramp);
+        return ss->cells[rng_int(rng, ss->upto[radius])];
+    }
+    int c = ss->cells[rng_int(rng, ss->ncells)];
+    if (ss->mode == START_VISITS && ss->total_visits > 0){
+        float mean = (float)ss->total_visits / (float)ss->ncells;
+        for (int tries=0; tries<64; ++tries){
+            if (rng_float(rng) * (1.0f + (float)ss->visits[c] / mean) < 1.0f) break;
+            c = ss->cells[rng_int(rng, ss->ncells)];
+        }
+    }
+    return c;
+}
+
+static inline void starts_visit(StartSampler *ss, int s){
+    if (ss->visits){ ss->visits[s]++; ss->total_visits++; }
+}
+
+// ---------------------------------------------------------------------------
+// Learned model and prioritized sweeping
+// ---------------------------------------------------------------------------
+
+// Deterministic model learned from observed transitions, indexed by
+// sa = s*ACTIONS + a. Because each (s,a) has a single successor, it sits on
+// exactly one predecessor list, so the lists are threaded through pred_next
+// with no allocation after setup.
+typedef struct {
+    int S;
+    int *next;        // S*ACTIONS: successor, S = goal (terminal), -1 = unseen
+    float *reward;    // S*ACTIONS
+    int *pred_head;   // S: first sa leading into the state, -1 = none
+    int *pred_next;   // S*ACTIONS: next sa on the same predecessor list
+} LearnedModel;
+
+void model_init(LearnedModel *mdl, int S){
+    size_t SA = (size_t)S * ACTIONS;
+    mdl->S = S;
+    mdl->next = (int*)malloc(sizeof(int) * SA);
+    mdl->reward = (float*)malloc(sizeof(float) * SA);
+    mdl->pred_head = (int*)malloc(sizeof(int) * (size_t)S);
+    mdl->pred_next = (int*)malloc(sizeof(int) * SA);
+    if (!mdl->next || !mdl->reward || !mdl->pred_head || !mdl->pred_next){
+        fprintf(stderr, "OOM\n"); exit(1);
+    }
+    for (size_t i=0; i<SA; ++i) mdl->next[i] = -1;
+    for (int s=0; s<S; ++s) mdl->pred_head[s] = -1;
+}
+
+void model_free(LearnedModel *mdl){
+    free(mdl->next); free(mdl->reward); free(mdl->pred_head); free(mdl->pred_next);
+    mdl->next = NULL; mdl->reward = NULL; mdl->pred_head = NULL; mdl->pred_next = NULL;
+}
+
+// Record (s,a) -> (ns, r); returns 1 the first time the pair is seen.
+static int model_observe(LearnedModel *mdl, int s, int a, int ns, float r){
+    int sa = s*ACTIONS + a;
+    mdl->reward[sa] = r;
+    if (mdl->next[sa] >= 0) return 0;
+    mdl->next[sa] = ns;
+    if (ns < mdl->S){
+        mdl->pred_next[sa] = mdl->pred_head[ns];
+        mdl->pred_head[ns] = sa;
+    }
+    return 1;
+}
+
+// One-step Q-learning update of (s,a) from the model; returns |TD error|.
+static inline float model_backup(const LearnedModel *mdl, QModel *m, const Env *env,
+                                 int sa, float alpha, float gamma){
+    int ns = mdl->next[sa];
+    float target = mdl->reward[sa] + (ns < mdl->S ? gamma * maxQ(m, env, ns) : 0.0f);
+    float *Qsa = &m->q[idxQ(env, sa / ACTIONS, sa % ACTIONS)];
+    float td = target - *Qsa;
+    *Qsa += alpha * td;
+    return fabsf(td);
+}
+
+// Max-heap over sa ids keyed by priority, with pos[] so an entry already in
+// the queue can be found and raised in O(log n) instead of duplicated.
+typedef struct {
+    int n;
+    int *heap;      // sa ids
+    float *key;     // S*ACTIONS, valid while queued
+    int *pos;       // S*ACTIONS, index in heap or -1
+} IndexedHeap;
+
+void iheap_init(IndexedHeap *h, int SA){
+    h->n = 0;
+    h->heap = (int*)malloc(sizeof(int) * (size_t)SA);
+    h->key = (float*)malloc(sizeof(float) * (size_t)SA);
+    h->pos = (int*)malloc(sizeof(int) * (size_t)SA);
+    if (!h->heap || !h->key || !h->pos){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int i=0; i<SA; ++i) h->pos[i] = -1;
+}
+
+void iheap_free(IndexedHeap *h){
+    free(h->heap); free(h->key); free(h->pos);
+    h->heap = NULL; h->key = NULL; h->pos = NULL;
+}
+
+static void iheap_sift_up(IndexedHeap *h, int i){
+    int id = h->heap[i];
+    float k = h->key[id];
+    while (i > 0){
+        int p = (i - 1) / 2;
+        if (h->key[h->heap[p]] >= k) break;
+        h->heap[i] = h->heap[p];
+        h->pos[h->heap[i]] = i;
+        i = p;
+    }
+    h->heap[i] = id;
+    h->pos[id] = i;
+}
+
+static void iheap_sift_down(IndexedHeap *h, int i){
+    int id = h->heap[i];
+    float k = h->key[id];
+    for (;;){
+        int c = 2*i + 1;
+        if (c >= h->n) break;
+        if (c+1 < h->n && h->key[h->heap[c+1]] > h->key[h->heap[c]]) c++;
+        if (h->key[h->heap[c]] <= k) break;
+        h->heap[i] = h->heap[c];
+        h->pos[h->heap[i]] = i;
+        i = c;
+    }
+    h->heap[i] = id;
+    h->pos[id] = i;
+}
+
+// Insert id, or raise its priority if it is already queued with a lower one.
+static void iheap_push(IndexedHeap *h, int id, float prio){
+    if (h->pos[id] >= 0){
+        if (prio > h->key[id]){ h->key[id] = prio; iheap_sift_up(h, h->pos[id]); }
+        return;
+    }
+    h->key[id] = prio;
+    h->heap[h->n] = id;
+    h->pos[id] = h->n;
+    h->n++;
+    iheap_sift_up(h, h->n - 1);
+}
+
+static int iheap_pop(IndexedHeap *h){
+    int top = h->heap[0];
+    h->pos[top] = -1;
+    if (--h->n > 0){
+        h->heap[0] = h->heap[h->n];
+        iheap_sift_down(h, 0);
+    }
+    return top;
+}
+
+// Prioritized sweeping step (Moore & Atkeson 1993): record the transition,
+// queue (s,a) by its |TD error|, then perform up to n updates in priority
+// order, queueing the predecessors of every state whose value changed.
+// The dynamics are deterministic, so the model is exact once observed and the
+// backups are full (alpha = 1). Returns the number of Q updates performed.
+static long long psweep_step(LearnedModel *mdl, IndexedHeap *pq, QModel *m, const Env *env,
+                             int s, int a, float r, int ns, int n, float theta, float gamma){
+    int sa = s*ACTIONS + a;
+    model_observe(mdl, s, a, ns, r);
+    float target = r + (ns < mdl->S ? gamma * maxQ(m, env, ns) : 0.0f);
+    float p = fabsf(target - m->q[idxQ(env, s, a)]);
+    if (p > theta) iheap_push(pq, sa, p);
+    long long updates = 0;
+    while (updates < n && pq->n > 0){
+        int top = iheap_pop(pq);
+        model_backup(mdl, m, env, top, 1.0f, gamma);
+        updates++;
+        int st = top / ACTIONS;
+        float v = maxQ(m, env, st);
+        for (int psa = mdl->pred_head[st]; psa >= 0; psa = mdl->pred_next[psa]){
+            float pr = fabsf(mdl->reward[psa] + gamma * v
+                             - m->q[idxQ(env, psa / ACTIONS, psa % ACTIONS)]);
+            if (pr > theta) iheap_push(pq, psa, pr);
+        }
+    }
+    return updates;
+}
+
+// ---------------------------------------------------------------------------
+// Experience replay
+// ---------------------------------------------------------------------------
+
+// 12-byte transition. State ids are < 2^28 (MAX_W*MAX_H), which leaves the
+// top nibble of ns_ad for the action (2 bits) and the done flag.
+typedef struct {
+    uint32_t s;
+    uint32_t ns_ad;   // ns | a << 28 | done << 30
+    float r;
+} PackedTransition;
+
+#define PT_NS_MASK 0x0FFFFFFFu
+
+typedef struct {
+    PackedTransition *buf;
+    int cap, size, head;
+    PackedTransition *batch, *tmp;   // minibatch and bucket-sort scratch
+    int batch_size;
+    int sorted;                      // sort minibatches by state id
+} ReplayBuffer;
+
+void replay_init(ReplayBuffer *rb, int cap, int batch_size, int sorted){
+    rb->cap = cap; rb->size = 0; rb->head = 0;
+    rb->batch_size = batch_size; rb->sorted = sorted;
+    rb->buf = (PackedTransition*)malloc(sizeof(PackedTransition) * (size_t)cap);
+    rb->batch = (PackedTransition*)malloc(sizeof(PackedTransition) * (size_t)batch_size);
+    rb->tmp = (PackedTransition*)malloc(sizeof(PackedTransition) * (size_t)batch_size);
+    if (!rb->buf || !rb->batch || !rb->tmp){ fprintf(stderr, "OOM\n"); exit(1); }
+}
+
+void replay_free(ReplayBuffer *rb){
+    free(rb->buf); free(rb->batch); free(rb->tmp);
+    rb->buf = NULL; rb->batch = NULL; rb->tmp = NULL;
+}
+
+static inline void pt_pack(PackedTransition *t, int s, int a, float r, int ns, int done){
+    t->s = (uint32_t)s;
+    t->ns_ad = (uint32_t)ns | (uint32_t)a << 28 | (uint32_t)(done != 0) << 30;
+    t->r = r;
+}
+
+// One-step Q-learning update from a stored transition.
+static inline void pt_apply(const PackedTransition *t, QModel *m, const Env *env,
+                            float alpha, float gamma){
+    int ns = (int)(t->ns_ad & PT_NS_MASK), a = (int)(t->ns_ad >> 28) & 3;
+    int done = (int)(t->ns_ad >> 30) & 1;
+    float target = t->r + (done ? 0.0f : gamma * maxQ(m, env, ns));
+    float *Qsa = &m->q[idxQ(env, (int)t->s, a)];
+    *Qsa += alpha * (target - *Qsa);
+}
+
+static inline void replay_push(ReplayBuffer *rb, int s, int a, float r, int ns, int done){
+    pt_pack(&rb->buf[rb->head], s, a, r, ns, done);
+    if (++rb->head == rb->cap) rb->head = 0;
+    if (rb->size < rb->cap) rb->size++;
+}
+
+// Bucket the minibatch by the top 8 bits of s (one counting-sort pass), so
+// updates walk the Q-table in 256 address-ordered bands instead of at random.
+static void replay_sort_batch(ReplayBuffer *rb, int n, uint32_t max_s){
+    int shift = 0;
+    while ((max_s >> shift) > 0xFF) shift++;
+    int count[257] = { 0 };
+    const PackedTransition *src = rb->batch;
+    for (int i=0; i<n; ++i) count[(src[i].s >> shift) + 1]++;
+    for (int b=0; b<256; ++b) count[b+1] += count[b];
+    for (int i=0; i<n; ++i) rb->tmp[count[src[i].s >> shift]++] = src[i];
+    memcpy(rb->batch, rb->tmp, sizeof(PackedTransition) * (size_t)n);
+}
+
+// Sample a minibatch uniformly (with replacement), optionally sort it by state
+// so the Q rows are touched in address order, and apply one Q-learning update
+// per transition. Returns the number of updates.
+static int replay_update(ReplayBuffer *rb, QModel *m, const Env *env,
+                         float alpha, float gamma, Rng *rng){
+    int n = rb->batch_size;
+    if (rb->size < n) return 0;
+    uint32_t max_s = 0;
+    for (int i=0; i<n; ++i){
+        rb->batch[i] = rb->buf[rng_int(rng, rb->size)];
+        if (rb->batch[i].s > max_s) max_s = rb->batch[i].s;
+    }
+    if (rb->sorted) replay_sort_batch(rb, n, max_s);
+    for (int i=0; i<n; ++i) pt_apply(&rb->batch[i], m, env, alpha, gamma);
+    return n;
+}
+
+// Backward episode replay (Lin 1992): once an episode ends, its transitions
+// are applied again from last to first, so the goal reward travels the whole
+// path in one pass. The trajectory buffer is owned by train(), grows by
+// doubling, and is reused by every episode.
+static int backward_replay(const PackedTransition *traj, int n, QModel *m, const Env *env,
+                           float alpha, float gamma){
+    for (int i=n-1; i>=0; --i) pt_apply(&traj[i], m, env, alpha, gamma);
+    return n;
+}
+
+// Grows the trajectory buffer to hold at least n transitions.
+static void traj_reserve(PackedTransition **traj, int *cap, int n){
+    if (n <= *cap) return;
+    int c = *cap ? *cap : 1024;
+    while (c < n) c *= 2;
+    *traj = (PackedTransition*)realloc(*traj, sizeof(PackedTransition) * (size_t)c);
+    if (!*traj){ fprintf(stderr, "OOM\n"); exit(1); }
+    *cap = c;
+}
+
+// ---------------------------------------------------------------------------
+// Eligibility traces (Watkins Q(lambda))
+// ---------------------------------------------------------------------------
+
+// Sparse trace set: the active (s,a) pairs and their traces in dense arrays,
+// plus a position index over all S*A pairs (-1 = no trace). Lookup, insert and
+// removal are O(1), and a sweep touches only the active pairs.
+typedef struct {
+    int *sa;        // active pairs
+    float *e;       // their traces
+    int n, cap;
+    int *pos;       // [S*A] slot in sa/e, or -1
+} TraceSet;
+
+void traces_init(TraceSet *t, int S){
+    int SA = S * ACTIONS;
+    t->n = 0; t->cap = 256;
+    t->sa = (int*)malloc(sizeof(int) * (size_t)t->cap);
+    t->e = (float*)malloc(sizeof(float) * (size_t)t->cap);
+    t->pos = (int*)malloc(sizeof(int) * (size_t)SA);
+    if (!t->sa || !t->e || !t->pos){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int i=0; i<SA; ++i) t->pos[i] = -1;
+}
+
+void traces_free(TraceSet *t){
+    free(t->sa); free(t->e); free(t->pos);
+    t->sa = NULL; t->e = NULL; t->pos = NULL;
+}
+
+static void traces_clear(TraceSet *t){
+    for (int i=0; i<t->n; ++i) t->pos[t->sa[i]] = -1;
+    t->n = 0;
+}
+
+// Room for at least n active pairs.
+static void traces_reserve(TraceSet *t, int n){
+    if (n <= t->cap) return;
+    while (t->cap < n) t->cap *= 2;
+    t->sa = (int*)realloc(t->sa, sizeof(int) * (size_t)t->cap);
+    t->e = (float*)realloc(t->e, sizeof(float) * (size_t)t->cap);
+    if (!t->sa || !t->e){ fprintf(stderr, "OOM\n"); exit(1); }
+}
+
+// Replacing trace: the visited pair's trace is reset to 1.
+static void traces_visit(TraceSet *t, int sa){
+    int i = t->pos[sa];
+    if (i < 0){
+        if (t->n == t->cap) traces_reserve(t, t->n + 1);
+        i = t->n++;
+        t->sa[i] = sa;
+        t->pos[sa] = i;
+    }
+    t->e[i] = 1.0f;
+}
+
+// Apply one TD error to every traced pair, then decay the traces by
+// gamma*lambda and drop those below trace_min (swap with the last slot).
+// Returns the number of Q entries updated.
+static int traces_update(TraceSet *t, QModel *m, const Env *env, float alpha_delta,
+                         float decay, float trace_min){
+    int n = t->n;
+    for (int i=0; i<t->n; ){
+        int sa = t->sa[i];
+        m->q[idxQ(env, sa / ACTIONS, sa % ACTIONS)] += alpha_delta * t->e[i];
+        float e = t->e[i] * decay;
+        if (e < trace_min){
+            t->pos[sa] = -1;
+            if (i < --t->n){
+                t->sa[i] = t->sa[t->n];
+                t->e[i] = t->e[t->n];
+                t->pos[t->sa[i]] = i;
+            }
+        } else {
+            t->e[i++] = e;
+        }
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// N-step Q-learning
+// ---------------------------------------------------------------------------
+
+// Circular window over the last n (s, a, r). Once it is full, each step
+// updates the oldest entry toward
+//   G + gamma^n max_a Q(s', a),   G = r_0 + gamma r_1 + ... + gamma^(n-1) r_(n-1)
+// and drops it. G is a running sum kept in two parts, so a step neither
+// subtracts nor divides by gamma: suf[slot] is the discounted sum from slot to
+// the end of the front run (the nfront oldest entries), and back is the
+// discounted sum of the entries pushed after it, so
+//   G = suf[head] + gamma^nfront * back.
+// Dropping the oldest entry just moves head. Once the front run is used up,
+// one Horner pass over the window rebuilds suf, i.e. once every n steps.
+// Rewards are mirrored into r[slot+n], so that pass and the episode-end flush
+// read the window as the contiguous run r[head .. head+len-1].
+typedef struct {
+    int n, len, head;       // head = slot of the oldest entry
+    int nfront;             // oldest entries covered by suf
+    float back;             // discounted sum of the len-nfront newest entries
+    int *s;
+    unsigned char *a;
+    float *r;               // 2n: r[i] is mirrored into r[i+n]
+    float *suf;             // suf[slot]: discounted sum from slot to the front's end
+    float *gpow;            // gamma^0 .. gamma^n
+} NStepWindow;
+
+typedef int (*NStepFn)(NStepWindow *w, QModel *m, const Env *env, int s, int a, float r,
+                       int ns, int done, float alpha);
+
+void nstep_init(NStepWindow *w, int n, float gamma){
+    // With gamma = 0 every n-step return is just r, i.e. one-step
+    if (gamma <= 0.0f) n = 1;
+    w->n = n; w->len = 0; w->head = 0;
+    w->nfront = 0; w->back = 0.0f;
+    w->s = (int*)malloc(sizeof(int) * (size_t)n);
+    w->a = (unsigned char*)malloc((size_t)n);
+    w->r = (float*)malloc(sizeof(float) * (size_t)(2*n));
+    w->suf = (float*)malloc(sizeof(float) * (size_t)n);
+    w->gpow = (float*)malloc(sizeof(float) * (size_t)(n+1));
+    if (!w->s || !w->a || !w->r || !w->suf || !w->gpow){ fprintf(stderr, "OOM\n"); exit(1); }
+    w->gpow[0] = 1.0f;
+    for (int k=1; k<=n; ++k) w->gpow[k] = w->gpow[k-1] * gamma;
+}
+
+void nstep_free(NStepWindow *w){
+    free(w->s); free(w->a); free(w->r); free(w->suf); free(w->gpow);
+    w->s = NULL; w->a = NULL; w->r = NULL; w->suf = NULL; w->gpow = NULL;
+}
+
+static inline void nstep_push(NStepWindow *w, int s, int a, float r){
+    int slot = w->head + w->len;
+    if (slot >= w->n) slot -= w->n;
+    w->s[slot] = s; w->a[slot] = (unsigned char)a;
+    w->r[slot] = r; w->r[slot + w->n] = r;
+    w->back += w->gpow[w->len - w->nfront] * r;
+    w->len++;
+}
+
+static inline void nstep_apply(NStepWindow *w, QModel *m, const Env *env, float target,
+                               float alpha){
+    float *Qsa = &m->q[idxQ(env, w->s[w->head], w->a[w->head])];
+    *Qsa += alpha * (target - *Qsa);
+    w->len--;
+    if (++w->head == w->n) w->head = 0;
+}
+
+// One step with the running sum: O(1), plus the O(n) rebuild every n steps.
+static int nstep_step(NStepWindow *w, QModel *m, const Env *env, int s, int a, float r,
+                      int ns, int done, float alpha){
+    nstep_push(w, s, a, r);
+    int n = w->n, o = w->head;
+    if (w->len < n) return 0;
+    if (w->nfront == 0){
+        float g = 0.0f;
+        for (int k=n-1; k>=0; --k){
+            g = w->r[o + k] + w->gpow[1] * g;
+            w->suf[o + k < n ? o + k : o + k - n] = g;
+        }
+        w->nfront = n;
+        w->back = 0.0f;
+    }
+    float target = w->suf[o] + w->gpow[w->nfront] * w->back
+                 + (done ? 0.0f : w->gpow[n] * maxQ(m, env, ns));
+    w->nfront--;
+    nstep_apply(w, m, env, target, alpha);
+    return 1;
+}
+
+// Reference for --bench-nstep: the same update with G summed from scratch
+// over the window on every step, O(n).
+static int nstep_step_recompute(NStepWindow *w, QModel *m, const Env *env, int s, int a,
+                                float r, int ns, int done, float alpha){
+    nstep_push(w, s, a, r);
+    int n = w->n, o = w->head;
+    if (w->len < n) return 0;
+    float target = done ? 0.0f : w->gpow[n] * maxQ(m, env, ns);
+    for (int k=0; k<n; ++k) target += w->gpow[k] * w->r[o + k];
+    nstep_apply(w, m, env, target, alpha);
+    return 1;
+}
+
+// Episode end: every entry still in the window gets its truncated return,
+// bootstrapped from ns unless the episode terminated. Returns the update count.
+static int nstep_flush(NStepWindow *w, QModel *m, const Env *env, int ns, int done, float alpha){
+    int n = w->len;
+    float g = done ? 0.0f : maxQ(m, env, ns);
+    for (int k=n-1; k>=0; --k){
+        int j = w->head + k;
+        if (j >= w->n) j -= w->n;
+        g = w->r[j] + w->gpow[1] * g;
+        float *Qsa = &m->q[idxQ(env, w->s[j], w->a[j])];
+        *Qsa += alpha * (g - *Qsa);
+    }
+    w->len = 0; w->head = 0;
+    w->nfront = 0; w->back = 0.0f;
+    return n;
+}
+
+// Dyna-Q planning (Sutton 1990): n extra one-step updates on (s,a) pairs drawn
+// uniformly from those seen so far. visited[] is a dense list of seen sa ids,
+// so drawing one is a single rng_int() and index.
+static long long dyna_plan(const LearnedModel *mdl, const int *visited, int nvisited,
+                           QModel *m, const Env *env, int n, float alpha, float gamma, Rng *rng){
+    if (nvisited == 0) return 0;
+    for (int i=0; i<n; ++i){
+        int sa = visited[rng_int(rng, nvisited)];
+        model_backup(mdl, m, env, sa, alpha, gamma);
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Training state for exact resume: everything train() carries from one
+// episode to the next besides Q. That is the RNG, the episode and step
+// counters (epsilon and the reverse-start radius are functions of the
+// episode), the running averages, visit counts, the replay buffer and the
+// learned model. It is saved after the table (QtHeader.state_bytes) and
+// handed back through TrainConfig.resume. A state taken mid-episode also
+// holds that episode's buffers: the n-step window, the eligibility traces
+// and the backward trajectory so far.
+// ---------------------------------------------------------------------------
+
+#define TS_MAGIC 0x32535451u   // "QTS2"
+#define TS_MAX_CHUNKS 18
+
+typedef struct {
+    uint32_t magic;
+    int32_t S;
+    // Which arrays follow this header; a resumed run must have the same
+    int32_t visits, replay_cap, model, heap, dyna;
+    int32_t nstep, traces, backward;   // nstep = window size, 0 if off
+    int32_t in_episode;       // taken mid-episode: agent at (x, y) after ep_steps
+    uint64_t rng;
+    int64_t episodes;         // completed episodes
+    int64_t steps, updates;   // totals over all runs
+    double avg_len, avg_ret;  // sums since the last "Episode N" line
+    int64_t total_visits;
+    int32_t x, y, ep_steps;
+    float ep_ret;
+    int32_t replay_size, replay_head, nvisited, heap_n;
+    // Episode buffers, mid-episode only; the trajectory has ep_steps entries
+    int32_t nstep_len, nstep_head, nstep_nfront;
+    float nstep_back;
+    int32_t trace_n;
+} TrainStateHeader;
+
+typedef struct {
+    TrainStateHeader hd;
+    StartSampler *starts;
+    ReplayBuffer *rb;         // NULL where the feature is off
+    LearnedModel *mdl;
+    IndexedHeap *pq;
+    int *visited;
+    NStepWindow *nw;
+    TraceSet *tr;
+    PackedTransition **traj;  // train()'s buffer, which moves as it grows
+    int *traj_cap;
+} TrainState;
+
+static void train_state_init(TrainState *ts, int S, StartSampler *starts, ReplayBuffer *rb,
+                             LearnedModel *mdl, IndexedHeap *pq, int *visited,
+                             NStepWindow *nw, TraceSet *tr, PackedTransition **traj,
+                             int *traj_cap){
+    memset(ts, 0, sizeof(*ts));
+    ts->hd.magic = TS_MAGIC;
+    ts->hd.S = S;
+    ts->hd.visits = starts->visits != NULL;
+    ts->hd.replay_cap = rb ? rb->cap : 0;
+    ts->hd.model = mdl != NULL;
+    ts->hd.heap = pq != NULL;
+    ts->hd.dyna = visited != NULL;
+    ts->hd.nstep = nw ? nw->n : 0;
+    ts->hd.traces = tr != NULL;
+    ts->hd.backward = traj != NULL;
+    ts->starts = starts; ts->rb = rb; ts->mdl = mdl; ts->pq = pq; ts->visited = visited;
+    ts->nw = nw; ts->tr = tr; ts->traj = traj; ts->traj_cap = traj_cap;
+}
+
+// Records the scalars at the end of episode `episodes`. A mid-episode
+// snapshot then adds the agent with train_state_mark_mid.
+static void train_state_mark(TrainState *ts, const Rng *rng, long long episodes,
+                             const TrainResult *res, double avg_len, double avg_ret, int nvisited){
+    TrainStateHeader *h = &ts->hd;
+    h->rng = rng->s;
+    h->episodes = episodes;
+    h->steps = res->steps;
+    h->updates = res->updates;
+    h->avg_len = avg_len;
+    h->avg_ret = avg_ret;
+    h->total_visits = ts->starts->total_visits;
+    h->in_episode = 0;
+    h->x = h->y = h->ep_steps = 0;
+    h->ep_ret = 0.0f;
+    h->replay_size = ts->rb ? ts->rb->size : 0;
+    h->replay_head = ts->rb ? ts->rb->head : 0;
+    h->nvisited = nvisited;
+    h->heap_n = ts->pq ? ts->pq->n : 0;
+    h->nstep_len = h->nstep_head = h->nstep_nfront = 0;
+    h->nstep_back = 0.0f;
+    h->trace_n = 0;
+}
+
+static void train_state_mark_mid(TrainState *ts, Pos s, int steps, float ret){
+    TrainStateHeader *h = &ts->hd;
+    h->in_episode = 1;
+    h->x = s.x; h->y = s.y;
+    h->ep_steps = steps;
+    h->ep_ret = ret;
+    if (ts->nw){
+        h->nstep_len = ts->nw->len;
+        h->nstep_head = ts->nw->head;
+        h->nstep_nfront = ts->nw->nfront;
+        h->nstep_back = ts->nw->back;
+    }
+    if (ts->tr) h->trace_n = ts->tr->n;
+}
+
+// The block as chunks for save_qtable_state; returns how many.
+static int train_state_chunks(const TrainState *ts, QtChunk *c){
+    size_t S = (size_t)ts->hd.S, SA = S * ACTIONS;
+    int n = 0;
+    c[n++] = (QtChunk){ &ts->hd, sizeof(ts->hd) };
+    if (ts->hd.visits) c[n++] = (QtChunk){ ts->starts->visits, sizeof(unsigned) * S };
+    if (ts->hd.replay_cap)
+        c[n++] = (QtChunk){ ts->rb->buf, sizeof(PackedTransition) * (size_t)ts->hd.replay_size };
+    if (ts->hd.model){
+        c[n++] = (QtChunk){ ts->mdl->next, sizeof(int) * SA };
+        c[n++] = (QtChunk){ ts->mdl->reward, sizeof(float) * SA };
+        c[n++] = (QtChunk){ ts->mdl->pred_head, sizeof(int) * S };
+        c[n++] = (QtChunk){ ts->mdl->pred_next, sizeof(int) * SA };
+    }
+    if (ts->hd.dyna) c[n++] = (QtChunk){ ts->visited, sizeof(int) * (size_t)ts->hd.nvisited };
+    if (ts->hd.heap){
+        c[n++] = (QtChunk){ ts->pq->heap, sizeof(int) * (size_t)ts->hd.heap_n };
+        c[n++] = (QtChunk){ ts->pq->key, sizeof(float) * SA };
+        c[n++] = (QtChunk){ ts->pq->pos, sizeof(int) * SA };
+    }
+    if (ts->hd.nstep){
+        size_t w = (size_t)ts->hd.nstep;
+        c[n++] = (QtChunk){ ts->nw->s, sizeof(int) * w };
+        c[n++] = (QtChunk){ ts->nw->a, w };
+        c[n++] = (QtChunk){ ts->nw->r, sizeof(float) * 2 * w };
+        c[n++] = (QtChunk){ ts->nw->suf, sizeof(float) * w };
+    }
+    if (ts->hd.traces){
+        c[n++] = (QtChunk){ ts->tr->sa, sizeof(int) * (size_t)ts->hd.trace_n };
+        c[n++] = (QtChunk){ ts->tr->e, sizeof(float) * (size_t)ts->hd.trace_n };
+    }
+    if (ts->hd.backward)
+        c[n++] = (QtChunk){ *ts->traj, sizeof(PackedTransition)
+                                       * (size_t)(ts->hd.in_episode ? ts->hd.ep_steps : 0) };
+    return n;
+}
+
+// The block in one malloc'd buffer (for the final --save).
+static void *train_state_pack(const TrainState *ts, size_t *bytes){
+    QtChunk c[TS_MAX_CHUNKS];
+    int n = train_state_chunks(ts, c);
+    *bytes = 0;
+    for (int i=0; i<n; ++i) *bytes += c[i].bytes;
+    char *buf = (char*)malloc(*bytes), *p = buf;
+    if (!buf){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int i=0; i<n; ++i){ memcpy(p, c[i].p, c[i].bytes); p += c[i].bytes; }
+    return buf;
+}
+
+// Copies a saved block into ts's structures, which must be set up for the
+// same run. Returns NULL, or why the block does not fit.
+static const char *train_state_restore(TrainState *ts, const void *buf, size_t bytes){
+    TrainStateHeader h;
+    uint32_t magic = 0;
+    if (bytes >= sizeof(magic)) memcpy(&magic, buf, sizeof(magic));
+    if (magic != TS_MAGIC) return "unknown format";   // also an older layout
+    if (bytes < sizeof(h)) return "truncated";
+    memcpy(&h, buf, sizeof(h));
+    if (h.S != ts->hd.S || h.visits != ts->hd.visits || h.replay_cap != ts->hd.replay_cap
+        || h.model != ts->hd.model || h.heap != ts->hd.heap || h.dyna != ts->hd.dyna
+        || h.nstep != ts->hd.nstep || h.traces != ts->hd.traces || h.backward != ts->hd.backward)
+        return "saved for another map size or other --starts/--replay/--psweep/--dyna/"
+               "--nstep/--lambda/--backward";
+    long long SA = (long long)h.S * ACTIONS;
+    if (h.episodes < 0 || h.episodes >= INT_MAX || h.replay_size < 0 || h.replay_size > h.replay_cap
+        || h.replay_head < 0 || h.replay_head > h.replay_size || h.nvisited < 0 || h.nvisited > SA
+        || h.heap_n < 0 || h.heap_n > SA || (h.in_episode && (h.x < 0 || h.y < 0 || h.ep_steps < 0))
+        || h.nstep_len < 0 || (h.nstep && h.nstep_len >= h.nstep) || h.nstep_head < 0
+        || (h.nstep && h.nstep_head >= h.nstep) || h.nstep_nfront < 0
+        || h.nstep_nfront > h.nstep_len || h.trace_n < 0 || h.trace_n > SA)
+        return "corrupt";
+    TrainState saved = *ts;
+    saved.hd = h;
+    QtChunk c[TS_MAX_CHUNKS];
+    int n = train_state_chunks(&saved, c);
+    size_t total = 0;
+    for (int i=0; i<n; ++i) total += c[i].bytes;
+    if (total != bytes) return "size mismatch";
+    // The episode buffers grow to fit, which can move them
+    if (ts->tr) traces_reserve(ts->tr, h.trace_n);
+    if (ts->traj && h.in_episode) traj_reserve(ts->traj, ts->traj_cap, h.ep_steps);
+    n = train_state_chunks(&saved, c);
+    const char *p = (const char*)buf + sizeof(h);
+    for (int i=1; i<n; ++i){ memcpy((void*)c[i].p, p, c[i].bytes); p += c[i].bytes; }
+    if (ts->tr){
+        // Rebuild the position index; the set was empty
+        TraceSet *t = ts->tr;
+        for (t->n = 0; t->n < h.trace_n; t->n++){
+            int sa = t->sa[t->n];
+            if (sa < 0 || sa >= SA || t->pos[sa] >= 0){ traces_clear(t); return "corrupt"; }
+            t->pos[sa] = t->n;
+        }
+    }
+    ts->hd = h;
+    ts->starts->total_visits = h.total_visits;
+    if (ts->rb){ ts->rb->size = h.replay_size; ts->rb->head = h.replay_head; }
+    if (ts->pq) ts->pq->n = h.heap_n;
+    if (ts->nw){
+        ts->nw->len = h.nstep_len;
+        ts->nw->head = h.nstep_head;
+        ts->nw->nfront = h.nstep_nfront;
+        ts->nw->back = h.nstep_back;
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Periodic checkpoints during train(). Taking one forks: the child holds a
+// copy-on-write snapshot of the process, writes the table and the training
+// state with save_qtable_state (tmp file + rename) and exits, while the
+// parent goes straight back to training. The parent only stalls for fork()
+// itself, which copies page tables, not the table. If the previous child is
+// still writing when the next checkpoint comes due, that checkpoint is
+// skipped. Like the training budgets, the time interval reads the clock at
+// most once every CLOCK_CHECK_STEPS environment steps.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char *path;
+    int every;              // episodes between checkpoints (0 = by time only)
+    double seconds;         // seconds between checkpoints (0 = by episodes only)
+    double last;            // time of the last checkpoint
+    long long clock_next;   // step count at which the clock is next read
+    pid_t child;            // writer still running, 0 if none
+    int written, skipped, failed;
+    double stall_max, stall_total;
+} Checkpointer;
+
+void checkpoint_init(Checkpointer *c, const TrainConfig *cfg){
+    memset(c, 0, sizeof(*c));
+    c->path = cfg->checkpoint_path;
+    c->every = cfg->checkpoint_every;
+    c->seconds = cfg->checkpoint_seconds;
+    c->last = now_sec();
+}
+
+// Collects a finished writer; block = wait for it.
+static void checkpoint_reap(Checkpointer *c, int block){
+    if (!c->child) return;
+    int st;
+    pid_t r = waitpid(c->child, &st, block ? 0 : WNOHANG);
+    if (r == 0) return;
+    if (r == c->child && WIFEXITED(st) && WEXITSTATUS(st) == 0) c->written++;
+    else c->failed++;
+    c->child = 0;
+}
+
+// Called at the end of episode ep, or with ep = 0 from inside an episode
+// (time interval only), after `steps` environment steps in total;
+// checkpoints if one is due. ts must be marked.
+void checkpoint_maybe(Checkpointer *c, int ep, long long steps, const QModel *m, const Env *env,
+                      const QtMeta *meta, const TrainState *ts){
+    if (!c->path) return;
+    int due = c->every > 0 && ep > 0 && ep % c->every == 0;
+    if (!due && c->seconds > 0.0 && steps >= c->clock_next){
+        c->clock_next = (steps | (CLOCK_CHECK_STEPS-1)) + 1;
+        due = now_sec() - c->last >= c->seconds;
+    }
+    if (!due) return;
+    double now = now_sec();
+    c->last = now;
+    checkpoint_reap(c, 0);
+    if (c->child){ c->skipped++; return; }
+    fflush(stdout);   // or the child would flush a copy of our buffered output
+    pid_t pid = fork();
+    if (pid == 0){
+        QtChunk chunks[TS_MAX_CHUNKS];
+        int n = train_state_chunks(ts, chunks), ok;
+        if (env->sym){
+            QModel full;
+            qmodel_unfold(m, env, &full);
+            ok = save_qtable_state(c->path, &full, meta, chunks, n);
+        } else {
+            ok = save_qtable_state(c->path, m, meta, chunks, n);
+        }
+        _exit(ok ? 0 : 1);
+    }
+    double stall = now_sec() - now;
+    if (pid < 0){ perror("fork"); c->failed++; return; }
+    c->child = pid;
+    c->stall_max = fmax(c->stall_max, stall);
+    c->stall_total += stall;
+}
+
+// Waits for the last writer, so a later save cannot be overwritten by it.
+void checkpoint_finish(Checkpointer *c){
+    if (!c->path) return;
+    checkpoint_reap(c, 1);
+    int taken = c->written + c->failed;
+    printf("Checkpoints to %s: %d written, %d skipped (writer busy), %d failed | "
+           "training stall max %.3f ms, mean %.3f ms\n", c->path, c->written, c->skipped,
+           c->failed, c->stall_max * 1e3, taken ? c->stall_total * 1e3 / taken : 0.0);
+}
+
+TrainResult train(Env *env, QModel *m, const TrainConfig *cfg){
+    int episodes = cfg->episodes, render_every = cfg->render_every;
+    float alpha = cfg->alpha, gamma = cfg->gamma;
+    float eps_start = cfg->eps_start, eps_min = cfg->eps_min, eps_decay = cfg->eps_decay;
+    double avg_len=0.0, avg_ret=0.0;
+    TrainResult res = { 0, 0, 0, 0, 0, 0.0 };
+    // Without an episode count, run until a budget or the optimality check stops us
+    int unbounded = episodes <= 0 && (cfg->max_seconds > 0.0 || cfg->max_steps > 0
+                                      || (cfg->check_every > 0 && cfg->dist));
+    int S = env->w * env->h;
+    LearnedModel mdl;
+    IndexedHeap pq;
+    int *visited = NULL, nvisited = 0;
+    if (cfg->psweep > 0 || cfg->dyna > 0) model_init(&mdl, S);
+    if (cfg->psweep > 0) iheap_init(&pq, S * ACTIONS);
+    if (cfg->dyna > 0){
+        visited = (int*)malloc(sizeof(int) * (size_t)S * ACTIONS);
+        if (!visited){ fprintf(stderr, "OOM\n"); exit(1); }
+    }
+    ReplayBuffer rb;
+    Rng rng = { (uint64_t)rand() };   // replay minibatches and start states
+    if (cfg->replay > 0) replay_init(&rb, cfg->replay, cfg->replay_batch, cfg->replay_sort);
+    TraceSet tr;
+    if (cfg->lambda > 0.0f) traces_init(&tr, S);
+    PackedTransition *traj = NULL;
+    int traj_cap = 0;
+    NStepWindow nw;
+    if (cfg->nstep > 1) nstep_init(&nw, cfg->nstep, gamma);
+    StartSampler starts;
+    starts_init(&starts, env, cfg->start_mode, cfg->dist, cfg->start_ramp);
+    TrainState ts;
+    train_state_init(&ts, S, &starts, cfg->replay > 0 ? &rb : NULL,
+                     cfg->psweep > 0 || cfg->dyna > 0 ? &mdl : NULL,
+                     cfg->psweep > 0 ? &pq : NULL, visited,
+                     cfg->nstep > 1 ? &nw : NULL, cfg->lambda > 0.0f ? &tr : NULL,
+                     cfg->backward ? &traj : NULL, &traj_cap);
+    int ep0 = 0, resume_mid = 0, cut = 0;
+    long long steps0 = 0, updates0 = 0;
+    if (cfg->resume){
+        const char *err = train_state_restore(&ts, cfg->resume, cfg->resume_bytes);
+        if (err){
+            printf("Training state not resumed (%s); starting at episode 1\n", err);
+        } else {
+            rng.s = ts.hd.rng;
+            ep0 = (int)ts.hd.episodes;
+            res.steps = ts.hd.steps;
+            res.updates = ts.hd.updates;
+            avg_len = ts.hd.avg_len;
+            avg_ret = ts.hd.avg_ret;
+            nvisited = ts.hd.nvisited;
+            resume_mid = ts.hd.in_episode;
+            steps0 = res.steps + (resume_mid ? ts.hd.ep_steps : 0);
+            updates0 = res.updates;
+            printf("Resuming after episode %d (%lld steps)%s\n", ep0, res.steps,
+                   resume_mid ? ", mid-episode" : "");
+        }
+    }
+    res.episodes = ep0;
+    Checkpointer ckpt;
+    checkpoint_init(&ckpt, cfg);
+    QtMeta meta = { alpha, gamma, eps_start, eps_min, eps_decay,
+                    env->step_reward, env->goal_reward, 0, NULL, 0 };
+    double t0 = now_sec();
+    for (int ep=ep0+1; unbounded || ep<=episodes; ++ep){
+        // Exponential epsilon decay
+        float eps = fmaxf(eps_min, eps_start * expf(-eps_decay * (float)ep));
+        Pos s;
+        int steps=0; float ret=0.0f;
+        if (resume_mid){
+            s = (Pos){ ts.hd.x, ts.hd.y };
+            steps = ts.hd.ep_steps;
+            ret = ts.hd.ep_ret;
+            resume_mid = 0;
+        } else {
+            int start = starts_sample(&starts, env, ep, &rng);
+            s = (Pos){ start % env->w, start / env->w };
+            if (cfg->lambda > 0.0f) traces_clear(&tr);
+        }
+        for (;;){
+            if (render_every>0 && (ep%render_every==0)){
+                printf("\n[Episode %d | eps=%.3f]\n", ep, eps);
+                render(env, s);
+            }
+            int s_id = state_id(env, s.x, s.y);
+            int a = eps_greedy_action_r(m, env, s_id, eps, &rng);
+            starts_visit(&starts, s_id);
+
+            float r; int done;
+            Pos ns = env_step(env, s, a, &r, &done);
+            int ns_id = state_id(env, ns.x, ns.y);
+
+            // Budgets end the episode early, like the step limit. The clock
+            // is read only every CLOCK_CHECK_STEPS steps.
+            long long total = res.steps + steps + 1;
+            if ((cfg->max_steps > 0 && total >= cfg->max_steps)
+                || (cfg->max_seconds > 0.0 && (total & (CLOCK_CHECK_STEPS-1)) == 0
+                    && now_sec() - t0 >= cfg->max_seconds))
+                res.budget = 1;
+
+            // Shaping F = gamma*phi(s') - phi(s), phi(s) = step_reward*dist(s),
+            // leaves the optimal policy unchanged (Ng et al. 1999).
+            float rs = r;
+            if (cfg->shape){
+                rs -= env->step_reward * (float)cfg->dist[s_id];
+                if (!done) rs += gamma * env->step_reward * (float)cfg->dist[ns_id];
+            }
+            if (cfg->replay > 0){
+                replay_push(&rb, s_id, a, rs, ns_id, done);
+                res.updates += replay_update(&rb, m, env, alpha, gamma, &rng);
+            } else if (cfg->psweep > 0){
+                res.updates += psweep_step(&mdl, &pq, m, env, s_id, a, rs, done ? S : ns_id,
+                                           cfg->psweep, cfg->psweep_theta, gamma);
+            } else if (cfg->nstep > 1){
+                res.updates += nstep_step(&nw, m, env, s_id, a, rs, ns_id, done, alpha);
+                if (done || steps+1 >= env->step_limit)
+                    res.updates += nstep_flush(&nw, m, env, ns_id, done, alpha);
+            } else {
+                float td_target = rs + (done ? 0.0f : gamma * maxQ(m, env, ns_id));
+                float *Qsa = &m->q[idxQ(env, s_id, a)];
+                if (cfg->lambda > 0.0f){
+                    // Watkins: traces only follow the greedy policy, so an
+                    // exploratory action cuts them
+                    if (*Qsa < maxQ(m, env, s_id)) traces_clear(&tr);
+                    traces_visit(&tr, s_id*ACTIONS + a);
+                    res.updates += traces_update(&tr, m, env, alpha * (td_target - *Qsa),
+                                                 gamma * cfg->lambda, cfg->trace_min);
+                } else {
+                    *Qsa += alpha * (td_target - *Qsa);
+                    res.updates++;
+                }
+                if (cfg->dyna > 0){
+                    if (model_observe(&mdl, s_id, a, done ? S : ns_id, rs))
+                        visited[nvisited++] = s_id*ACTIONS + a;
+                    res.updates += dyna_plan(&mdl, visited, nvisited, m, env,
+                                             cfg->dyna, alpha, gamma, &rng);
+                }
+            }
+
+            if (cfg->backward){
+                traj_reserve(&traj, &traj_cap, steps + 1);
+                pt_pack(&traj[steps], s_id, a, rs, ns_id, done);
+            }
+            ret += r;
+            s = ns;
+            steps++;
+            if (done || steps >= env->step_limit) break;
+            if (res.budget){
+                // Stopped mid-episode: the final state continues this episode
+                train_state_mark(&ts, &rng, ep - 1, &res, avg_len, avg_ret, nvisited);
+                train_state_mark_mid(&ts, s, steps, ret);
+                cut = 1;
+                break;
+            }
+            // Episodes on big maps can outlast the interval: in seconds mode,
+            // checkpoint mid-episode too, reading the clock as rarely as budgets do
+            if (ckpt.seconds > 0.0 && ((res.steps + steps) & (CLOCK_CHECK_STEPS-1)) == 0){
+                meta.episodes = ep - 1;
+                train_state_mark(&ts, &rng, ep - 1, &res, avg_len, avg_ret, nvisited);
+                train_state_mark_mid(&ts, s, steps, ret);
+                checkpoint_maybe(&ckpt, 0, res.steps + steps, m, env, &meta, &ts);
+            }
+        }
+        if (cut){
+            // Unfinished: only the mid-episode state holds it, and the run
+            // that finishes it counts, reports and checks it
+            res.episodes = ep - 1;
+            res.steps += steps;
+            break;
+        }
+        if (cfg->backward) res.updates += backward_replay(traj, steps, m, env, alpha, gamma);
+        avg_len += steps;
+        avg_ret += ret;
+        res.episodes = ep;
+        res.steps += steps;
+        if (ep % 100 == 0){
+            printf("Episode %5d | avg_len: %6.2f | avg_return: %7.3f\n",
+                   ep, avg_len/100.0, avg_ret/100.0);
+            avg_len = 0.0; avg_ret = 0.0;
+        }
+        if (cfg->check_every>0 && cfg->dist && ep % cfg->check_every == 0){
+            int opt = cfg->check_all ? policy_suboptimal_states(env, m, cfg->dist)==0
+                                     : policy_optimal_from_start(env, m, cfg->dist);
+            if (opt){
+                printf("Greedy policy optimal%s after %d episodes (%lld steps, %lld updates)\n",
+                       cfg->check_all ? " from all states" : " from start", ep, res.steps,
+                       res.updates);
+                res.optimal = 1;
+                break;
+            }
+        }
+        if (res.budget) break;
+        meta.episodes = ep;
+        train_state_mark(&ts, &rng, ep, &res, avg_len, avg_ret, nvisited);
+        checkpoint_maybe(&ckpt, ep, res.steps, m, env, &meta, &ts);
+    }
+    res.seconds = now_sec() - t0;
+    checkpoint_finish(&ckpt);
+    if (cfg->state_out){
+        if (!cut && !resume_mid) train_state_mark(&ts, &rng, res.episodes, &res, avg_len, avg_ret, nvisited);
+        *cfg->state_out = train_state_pack(&ts, cfg->state_out_bytes);
+    }
+    // This run's share; the state keeps the totals
+    res.episodes -= ep0;
+    res.steps -= steps0;
+    res.updates -= updates0;
+    if (cfg->psweep > 0 || cfg->dyna > 0) model_free(&mdl);
+    if (cfg->psweep > 0) iheap_free(&pq);
+    if (cfg->replay > 0) replay_free(&rb);
+    if (cfg->lambda > 0.0f) traces_free(&tr);
+    free(traj);
+    if (cfg->nstep > 1) nstep_free(&nw);
+    starts_free(&starts);
+    free(visited);
+    return res;
+}
+
+// ---------------------------------------------------------------------------
+// Bench fixture for the train-until-optimal comparisons (--bench-init,
+// --bench-psweep, ...). A bench lists its variants; bench_run() trains each
+// one on a fresh table from the same seed and prints one row per variant.
+// ---------------------------------------------------------------------------
+
+typedef struct BenchVariant BenchVariant;
+struct BenchVariant {
+    char label[24];
+    TrainConfig cfg;
+    const Symmetry *sym;   // Q-table layout (NULL = one row per state)
+    // Trains the fresh table; NULL = train(). mode, levels and value hold
+    // the hook's own settings (init mode, upsampling, ...).
+    TrainResult (*train)(Env *env, QModel *m, const BenchVariant *v);
+    int mode, levels;
+    float value;
+    TrainResult res;
+};
+
+// A variant of base with the bench defaults: at most 100000 episodes and an
+// optimality check every 10.
+static BenchVariant bench_variant(const TrainConfig *base, const char *label){
+    BenchVariant v;
+    memset(&v, 0, sizeof(v));
+    snprintf(v.label, sizeof(v.label), "%s", label);
+    v.cfg = *base;
+    if (v.cfg.episodes <= 0) v.cfg.episodes = 100000;
+    if (v.cfg.check_every <= 0) v.cfg.check_every = 10;
+    return v;
+}
+
+static void bench_run(Env *env, BenchVariant *v, int n, unsigned seed, const char *title,
+                      const char *column){
+    int *dist = NULL;
+    if (!v[0].cfg.dist){
+        dist = (int*)malloc(sizeof(int) * (size_t)env->w * (size_t)env->h);
+        if (!dist){ fprintf(stderr, "OOM\n"); exit(1); }
+        env_goal_distances(env, dist, 0);
+    }
+    const Symmetry *saved = env->sym;
+    for (int i=0; i<n; ++i){
+        if (dist) v[i].cfg.dist = dist;
+        env->sym = v[i].sym;
+        QModel q; qmodel_alloc_env(&q, env);
+        srand(seed);
+        v[i].res = v[i].train ? v[i].train(env, &q, &v[i]) : train(env, &q, &v[i].cfg);
+        qmodel_free(&q);
+        if (dist) v[i].cfg.dist = NULL;
+    }
+    env->sym = saved;
+    free(dist);
+    printf("\n%s to optimal greedy policy (%s), %dx%d\n", title,
+           v[0].cfg.check_all ? "all states" : "from start", env->w, env->h);
+    printf("%-12s %9s %12s %12s %9s %9s %10s %8s\n", column, "episodes", "steps", "updates",
+           "upd/step", "seconds", "steps/s", "optimal");
+    for (int i=0; i<n; ++i){
+        const TrainResult *r = &v[i].res;
+        printf("%-12s %9d %12lld %12lld %9.2f %9.3f %10.3g %8s\n", v[i].label, r->episodes,
+               r->steps, r->updates, r->steps > 0 ? (double)r->updates / (double)r->steps : 0.0,
+               r->seconds, r->seconds > 0.0 ? (double)r->steps / r->seconds : 0.0,
+               r->optimal ? "yes" : "no");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Parallel training
+//
+// Shared mode (Hogwild): every thread runs its own episodes and writes Q
+// directly; racy reads/writes are tolerated the same way Hogwild does.
+// Sharded mode (owner-computes): states are split into contiguous ranges of
+// whole cache lines, one per thread. A thread still acts on any state (reads
+// are shared), but the TD update for state s is sent to the owner of s via a
+// single-producer/single-consumer mailbox, so every Q line has one writer.
+// ---------------------------------------------------------------------------
+
+#define STATES_PER_LINE (CACHE_LINE / (ACTIONS*(int)sizeof(float)))
+#define MAILBOX_CAP 1024   // power of two
+
+typedef struct {
+    int s, ns;
+    float r;
+    unsigned char a, done;
+} Transition;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_uint head;   // advanced by the owner
+    _Alignas(CACHE_LINE) atomic_uint tail;   // advanced by the producer
+    _Alignas(CACHE_LINE) Transition buf[MAILBOX_CAP];
+} Mailbox;
+
+typedef struct {
+    Env *env;
+    QModel *m;
+    const TrainConfig *cfg;
+    int nthreads;
+    int shard_states;          // states per shard, multiple of STATES_PER_LINE
+    Mailbox *mail;             // [producer*nthreads + owner]
+    atomic_int next_ep;
+    atomic_int finished;
+    atomic_ushort *line_writer; // last writer per Q cache line (count_sharing)
+    StartSampler starts;       // read-only: uniform/reverse starts only
+} ParShared;
+
+typedef struct {
+    _Alignas(CACHE_LINE) ParShared *sh;
+    int id;
+    Rng rng;
+    long long steps, episodes, updates, remote_sent, line_transfers;
+    double ret_sum;
+} ParWorker;
+
+static inline int shard_owner(const ParShared *sh, int s){ return s / sh->shard_states; }
+
+static inline void par_apply(ParWorker *w, const Transition *t){
+    ParShared *sh = w->sh;
+    const TrainConfig *cfg = sh->cfg;
+    float td_target = t->r + (t->done ? 0.0f : cfg->gamma * maxQ(sh->m, sh->env, t->ns));
+    int qi = idxQ(sh->env, t->s, t->a);
+    float *Qsa = &sh->m->q[qi];
+    *Qsa += cfg->alpha * (td_target - *Qsa);
+    w->updates++;
+    if (sh->line_writer){
+        atomic_ushort *lw = &sh->line_writer[qi / (CACHE_LINE/(int)sizeof(float))];
+        if (atomic_load_explicit(lw, memory_order_relaxed) != (unsigned short)w->id){
+            atomic_store_explicit(lw, (unsigned short)w->id, memory_order_relaxed);
+            w->line_transfers++;
+        }
+    }
+}
+
+// Apply every pending update addressed to this worker's shard.
+static int par_drain(ParWorker *w){
+    ParShared *sh = w->sh;
+    int n = 0;
+    for (int p=0; p<sh->nthreads; ++p){
+        if (p==w->id) continue;
+        Mailbox *mb = &sh->mail[p*sh->nthreads + w->id];
+        unsigned head = atomic_load_explicit(&mb->head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&mb->tail, memory_order_acquire);
+        while (head != tail){
+            par_apply(w, &mb->buf[head & (MAILBOX_CAP-1)]);
+            head++; n++;
+        }
+        atomic_store_explicit(&mb->head, head, memory_order_release);
+    }
+    return n;
+}
+
+static void par_route(ParWorker *w, const Transition *t){
+    ParShared *sh = w->sh;
+    int owner = shard_owner(sh, t->s);
+    if (owner == w->id){ par_apply(w, t); return; }
+    Mailbox *mb = &sh->mail[w->id*sh->nthreads + owner];
+    unsigned tail = atomic_load_explicit(&mb->tail, memory_order_relaxed);
+    // Full: keep serving our own inbox so two full workers cannot deadlock
+    while (tail - atomic_load_explicit(&mb->head, memory_order_acquire) >= MAILBOX_CAP){
+        if (!par_drain(w)) sched_yield();
+    }
+    mb->buf[tail & (MAILBOX_CAP-1)] = *t;
+    atomic_store_explicit(&mb->tail, tail+1, memory_order_release);
+    w->remote_sent++;
+}
+
+static void *par_worker(void *arg){
+    ParWorker *w = (ParWorker*)arg;
+    ParShared *sh = w->sh;
+    const Env *env = sh->env;
+    const TrainConfig *cfg = sh->cfg;
+    for (;;){
+        int ep = atomic_fetch_add(&sh->next_ep, 1) + 1;
+        if (ep > cfg->episodes) break;
+        float eps = fmaxf(cfg->eps_min, cfg->eps_start * expf(-cfg->eps_decay * (float)ep));
+        int start = starts_sample(&sh->starts, env, ep, &w->rng);
+        Pos s = (Pos){ start % env->w, start / env->w };
+        int steps=0; float ret=0.0f;
+        for (;;){
+            if (cfg->sharded) par_drain(w);
+            int s_id = state_id(env, s.x, s.y);
+            int a = eps_greedy_action_r(sh->m, env, s_id, eps, &w->rng);
+            float r; int done;
+            Pos ns = env_step(env, s, a, &r, &done);
+            Transition t = { s_id, state_id(env, ns.x, ns.y), r,
+                             (unsigned char)a, (unsigned char)done };
+            if (cfg->sharded) par_route(w, &t);
+            else par_apply(w, &t);
+            ret += r;
+            s = ns;
+            steps++;
+            if (done || steps >= env->step_limit) break;
+        }
+        w->steps += steps;
+        w->episodes++;
+        w->ret_sum += ret;
+    }
+    if (cfg->sharded){
+        // Others may still route updates to us until every producer is done
+        atomic_fetch_add_explicit(&sh->finished, 1, memory_order_release);
+        while (atomic_load_explicit(&sh->finished, memory_order_acquire) < sh->nthreads){
+            if (!par_drain(w)) sched_yield();
+        }
+        par_drain(w);
+    }
+    return NULL;
+}
+
+typedef struct {
+    double seconds;
+    long long steps, episodes, updates, remote_sent, line_transfers;
+    double avg_return;
+} ParStats;
+
+ParStats train_parallel(Env *env, QModel *m, const TrainConfig *cfg, unsigned seed){
+    int T = cfg->threads;
+    int S = env->w * env->h;
+    ParShared sh;
+    sh.env = env; sh.m = m; sh.cfg = cfg; sh.nthreads = T;
+    int per = (S + T - 1) / T;
+    sh.shard_states = (per + STATES_PER_LINE - 1) / STATES_PER_LINE * STATES_PER_LINE;
+    atomic_init(&sh.next_ep, 0);
+    atomic_init(&sh.finished, 0);
+    sh.mail = NULL;
+    if (cfg->sharded){
+        sh.mail = (Mailbox*)aligned_alloc(CACHE_LINE, sizeof(Mailbox) * (size_t)T * (size_t)T);
+        if (!sh.mail){ fprintf(stderr, "OOM\n"); exit(1); }
+        for (int i=0; i<T*T; ++i){
+            atomic_init(&sh.mail[i].head, 0);
+            atomic_init(&sh.mail[i].tail, 0);
+        }
+    }
+    sh.line_writer = NULL;
+    if (cfg->count_sharing){
+        size_t lines = ((size_t)S*ACTIONS*sizeof(float) + CACHE_LINE-1) / CACHE_LINE;
+        sh.line_writer = (atomic_ushort*)malloc(lines * sizeof(atomic_ushort));
+        if (!sh.line_writer){ fprintf(stderr, "OOM\n"); exit(1); }
+        // No writer yet: a value outside the worker id range
+        for (size_t i=0; i<lines; ++i) atomic_init(&sh.line_writer[i], (unsigned short)MAX_THREADS);
+    }
+    starts_init(&sh.starts, env, cfg->start_mode, cfg->dist, cfg->start_ramp);
+
+    ParWorker *ws = (ParWorker*)aligned_alloc(CACHE_LINE, sizeof(ParWorker) * (size_t)T);
+    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)T);
+    if (!ws || !tids){ fprintf(stderr, "OOM\n"); exit(1); }
+    double t0 = now_sec();
+    for (int i=0; i<T; ++i){
+        memset(&ws[i], 0, sizeof(ws[i]));
+        ws[i].sh = &sh; ws[i].id = i;
+        ws[i].rng.s = (uint64_t)seed * 0x100000001B3ull + (uint64_t)i * 0x9E3779B97F4A7C15ull;
+        if (pthread_create(&tids[i], NULL, par_worker, &ws[i]) != 0){
+            fprintf(stderr, "pthread_create failed\n"); exit(1);
+        }
+    }
+    ParStats st;
+    memset(&st, 0, sizeof(st));
+    double ret_sum = 0.0;
+    for (int i=0; i<T; ++i){
+        pthread_join(tids[i], NULL);
+        st.steps += ws[i].steps; st.episodes += ws[i].episodes;
+        st.updates += ws[i].updates; st.remote_sent += ws[i].remote_sent;
+        st.line_transfers += ws[i].line_transfers;
+        ret_sum += ws[i].ret_sum;
+    }
+    st.seconds = now_sec() - t0;
+    st.avg_return = st.episodes ? ret_sum / (double)st.episodes : 0.0;
+    free(tids); free(ws); free(sh.mail); free(sh.line_writer);
+    starts_free(&sh.starts);
+    return st;
+}
+
+static void print_train_result(const TrainResult *r){
+    const char *why = r->optimal ? "policy optimal" : r->budget ? "budget reached" : "episodes done";
+    printf("Trained %d episodes, %lld steps, %lld updates in %.3fs (%s) | "
+           "steps/s=%.3g  updates/s=%.3g\n",
+           r->episodes, r->steps, r->updates, r->seconds, why,
+           r->seconds>0 ? (double)r->steps / r->seconds : 0.0,
+           r->seconds>0 ? (double)r->updates / r->seconds : 0.0);
+}
+
+static void print_par_stats(const char *label, const ParStats *st, int threads){
+    // line_transfers counts writes to a line last written by another thread
+    // (first touch included), i.e. the coherence traffic false sharing causes.
+    printf("%-8s threads=%-3d time=%.3fs  steps/s=%.3g  avg_return=%7.3f  "
+           "updates=%lld  mailbox=%lld  line_transfers=%lld\n",
+           label, threads, st->seconds,
+           st->seconds>0 ? (double)st->steps / st->seconds : 0.0,
+           st->avg_return, st->updates, st->remote_sent, st->line_transfers);
+}
+
+void bench_sharded(Env *env, const TrainConfig *base, unsigned seed){
+    TrainConfig cfg0 = *base;
+    if (cfg0.episodes <= 0) cfg0.episodes = 10000;
+    base = &cfg0;
+    printf("Shared (Hogwild) vs sharded owner-computes, %dx%d, %d episodes\n",
+           env->w, env->h, base->episodes);
+    for (int mode=0; mode<2; ++mode){
+        TrainConfig cfg = *base;
+        cfg.sharded = mode;
+        cfg.count_sharing = 1;
+        if (cfg.threads < 2) cfg.threads = 2;
+        QModel q; qmodel_alloc(&q, env->w, env->h);
+        ParStats st = train_parallel(env, &q, &cfg, seed);
+        print_par_stats(mode ? "sharded" : "shared", &st, cfg.threads);
+        qmodel_free(&q);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Model-based solver: value iteration on the known deterministic dynamics
+// ---------------------------------------------------------------------------
+
+#define VI_JACOBI 0
+#define VI_GAUSS_SEIDEL 1
+#define VI_RED_BLACK 2
+
+// Deterministic MDP as a transition table. nxt[s*ACTIONS+a] is the successor
+// of (s,a); entering the goal maps to the terminal index S, whose value is
+// pinned to 0. Walls and the goal itself are inactive (no row to update).
+typedef struct {
+    int S;
+    int *nxt;               // S*ACTIONS
+    unsigned char *active;  // S
+    float step_reward, goal_reward;
+    float gamma;
+} DetMdp;
+
+typedef struct {
+    int sweeps;
+    float delta;            // last max |V_new - V_old|
+    double seconds;
+} ViStats;
+
+void mdp_from_env(DetMdp *mdp, const Env *env, float gamma){
+    int S = env->w * env->h;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    mdp->S = S;
+    mdp->nxt = (int*)malloc(sizeof(int) * (size_t)S * ACTIONS);
+    mdp->active = (unsigned char*)malloc((size_t)S);
+    if (!mdp->nxt || !mdp->active){ fprintf(stderr, "OOM\n"); exit(1); }
+    mdp->step_reward = env->step_reward;
+    mdp->goal_reward = env->goal_reward;
+    mdp->gamma = gamma;
+    for (int s=0; s<S; ++s){
+        mdp->active[s] = !env->walls[s] && s!=goal;
+        for (int a=0; a<ACTIONS; ++a){
+            float r; int done;
+            Pos p = env_step(env, (Pos){ s % env->w, s / env->w }, a, &r, &done);
+            mdp->nxt[s*ACTIONS + a] = done ? S : state_id(env, p.x, p.y);
+        }
+    }
+}
+
+void mdp_free(DetMdp *mdp){
+    free(mdp->nxt); mdp->nxt=NULL;
+    free(mdp->active); mdp->active=NULL;
+}
+
+// Bellman backup of one state: max_a [ r(s,a) + gamma * V(nxt(s,a)) ].
+// The four actions fill one SSE register, so the row max is two shuffles.
+static inline float mdp_backup(const DetMdp *mdp, const float *V, int s){
+    const int *ns = &mdp->nxt[s*ACTIONS];
+#if defined(__SSE2__) && ACTIONS == 4
+    __m128i n4 = _mm_loadu_si128((const __m128i*)ns);
+    __m128 v4 = _mm_setr_ps(V[ns[0]], V[ns[1]], V[ns[2]], V[ns[3]]);
+    __m128 term = _mm_castsi128_ps(_mm_cmpeq_epi32(n4, _mm_set1_epi32(mdp->S)));
+    __m128 r4 = _mm_or_ps(_mm_and_ps(term, _mm_set1_ps(mdp->goal_reward)),
+                          _mm_andnot_ps(term, _mm_set1_ps(mdp->step_reward)));
+    __m128 q = _mm_add_ps(r4, _mm_mul_ps(_mm_set1_ps(mdp->gamma), v4));
+    __m128 m = _mm_max_ps(q, _mm_shuffle_ps(q, q, _MM_SHUFFLE(1,0,3,2)));
+    m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtss_f32(m);
+#else
+    float best = -INFINITY;
+    for (int a=0; a<ACTIONS; ++a){
+        float r = ns[a]==mdp->S ? mdp->goal_reward : mdp->step_reward;
+        float q = r + mdp->gamma * V[ns[a]];
+        if (q > best) best = q;
+    }
+    return best;
+#endif
+}
+
+// Solve for V (size S+1, V[S] is the terminal and stays 0). V may hold a warm
+// start. Jacobi reads only the previous sweep; Gauss-Seidel updates in place
+// and alternates sweep direction so values travel both ways each pair.
+// Stops once gamma/(1-gamma) * max|dV| < tol, which bounds |V - V*| by tol.
+ViStats value_iteration(const DetMdp *mdp, float *V, int method, float tol, int max_sweeps){
+    int S = mdp->S;
+    float stop = mdp->gamma < 1.0f ? tol * (1.0f - mdp->gamma) / mdp->gamma : tol;
+    ViStats st = { 0, INFINITY, 0.0 };
+    float *scratch = NULL, *cur = V, *Vn = NULL;
+    V[S] = 0.0f;
+    if (method == VI_JACOBI){
+        scratch = Vn = (float*)malloc(sizeof(float) * (size_t)(S+1));
+        if (!scratch){ fprintf(stderr, "OOM\n"); exit(1); }
+        memcpy(Vn, V, sizeof(float) * (size_t)(S+1));
+    }
+    double t0 = now_sec();
+    while (st.sweeps < max_sweeps && st.delta >= stop){
+        float delta = 0.0f;
+        if (method == VI_JACOBI){
+            for (int s=0; s<S; ++s){
+                if (!mdp->active[s]) continue;
+                float v = mdp_backup(mdp, cur, s);
+                delta = fmaxf(delta, fabsf(v - cur[s]));
+                Vn[s] = v;
+            }
+            float *t = cur; cur = Vn; Vn = t;
+        } else {
+            int fwd = (st.sweeps & 1) == 0;
+            for (int i=0; i<S; ++i){
+                int s = fwd ? i : S-1-i;
+                if (!mdp->active[s]) continue;
+                float v = mdp_backup(mdp, V, s);
+                delta = fmaxf(delta, fabsf(v - V[s]));
+                V[s] = v;
+            }
+        }
+        st.delta = delta;
+        st.sweeps++;
+    }
+    if (cur != V) memcpy(V, cur, sizeof(float) * (size_t)(S+1));
+    free(scratch);
+    st.seconds = now_sec() - t0;
+    return st;
+}
+
+// Parallel red-black value iteration. Each thread owns a band of rows (a
+// full-width tile). A sweep updates all red cells ((x+y) even), then all black
+// cells; every grid neighbour of a red cell is black, so threads update V in
+// place without locks and each half-sweep sees the freshest values, as in
+// Gauss-Seidel.
+typedef struct {
+    _Alignas(CACHE_LINE) float delta[2];   // per sweep parity
+} RbSlot;
+
+typedef struct {
+    const DetMdp *mdp;
+    float *V;
+    int w, h, nthreads, max_sweeps;
+    float stop;
+    Barrier bar;
+    RbSlot *slots;
+    int sweeps;
+    float delta;
+} RbShared;
+
+typedef struct {
+    RbShared *sh;
+    int id, y0, y1;
+} RbWorker;
+
+static void *rb_worker(void *arg){
+    RbWorker *wk = (RbWorker*)arg;
+    RbShared *sh = wk->sh;
+    const DetMdp *mdp = sh->mdp;
+    float *V = sh->V;
+    int w = sh->w;
+    for (int sweep=0; sweep<sh->max_sweeps; ++sweep){
+        float delta = 0.0f;
+        for (int color=0; color<2; ++color){
+            for (int y=wk->y0; y<wk->y1; ++y){
+                for (int x=(color ^ (y & 1)); x<w; x+=2){
+                    int s = y*w + x;
+                    if (!mdp->active[s]) continue;
+                    float v = mdp_backup(mdp, V, s);
+                    delta = fmaxf(delta, fabsf(v - V[s]));
+                    V[s] = v;
+                }
+            }
+            barrier_wait(&sh->bar);
+        }
+        // Every thread reduces the same slots, so all agree on stopping.
+        // Slots alternate by parity: a slot is rewritten only after everyone
+        // has passed the next sweep's first barrier, i.e. finished reading it.
+        sh->slots[wk->id].delta[sweep & 1] = delta;
+        barrier_wait(&sh->bar);
+        float all = 0.0f;
+        for (int t=0; t<sh->nthreads; ++t) all = fmaxf(all, sh->slots[t].delta[sweep & 1]);
+        if (wk->id == 0){ sh->sweeps = sweep + 1; sh->delta = all; }
+        if (all < sh->stop) break;
+    }
+    return NULL;
+}
+
+ViStats value_iteration_rb(const DetMdp *mdp, float *V, int w, int h,
+                           float tol, int max_sweeps, int threads){
+    RbShared sh;
+    sh.mdp = mdp; sh.V = V; sh.w = w; sh.h = h;
+    if (threads > h) threads = h;
+    sh.nthreads = threads; sh.max_sweeps = max_sweeps;
+    sh.stop = mdp->gamma < 1.0f ? tol * (1.0f - mdp->gamma) / mdp->gamma : tol;
+    sh.sweeps = 0; sh.delta = INFINITY;
+    barrier_init(&sh.bar, threads);
+    sh.slots = (RbSlot*)aligned_alloc(CACHE_LINE, sizeof(RbSlot) * (size_t)threads);
+    RbWorker *wk = (RbWorker*)malloc(sizeof(RbWorker) * (size_t)threads);
+    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)threads);
+    if (!sh.slots || !wk || !tids){ fprintf(stderr, "OOM\n"); exit(1); }
+    V[mdp->S] = 0.0f;
+    double t0 = now_sec();
+    for (int t=0; t<threads; ++t){
+        wk[t].sh = &sh; wk[t].id = t;
+        wk[t].y0 = (int)((long long)h * t / threads);
+        wk[t].y1 = (int)((long long)h * (t+1) / threads);
+    }
+    for (int t=1; t<threads; ++t){
+        if (pthread_create(&tids[t], NULL, rb_worker, &wk[t]) != 0){
+            fprintf(stderr, "pthread_create failed\n"); exit(1);
+        }
+    }
+    rb_worker(&wk[0]);
+    for (int t=1; t<threads; ++t) pthread_join(tids[t], NULL);
+    ViStats st = { sh.sweeps, sh.delta, now_sec() - t0 };
+    barrier_destroy(&sh.bar);
+    free(sh.slots); free(wk); free(tids);
+    return st;
+}
+
+// Coarsen a grid by 2x2 blocks. A block is passable if any of its cells is,
+// so no free region of the fine grid is cut off at the coarse level; start and
+// goal go to the blocks that contain them.
+void env_coarsen(const Env *fine, Env *coarse){
+    int cw = (fine->w + 1) / 2, ch = (fine->h + 1) / 2;
+    env_init(coarse, cw, ch);
+    memset(coarse->walls, 1, (size_t)cw * (size_t)ch);
+    for (int y=0; y<fine->h; ++y){
+        for (int x=0; x<fine->w; ++x){
+            if (!fine->walls[y*fine->w + x]) coarse->walls[(y/2)*cw + x/2] = 0;
+        }
+    }
+    coarse->start_x = fine->start_x / 2; coarse->start_y = fine->start_y / 2;
+    coarse->goal_x = fine->goal_x / 2;   coarse->goal_y = fine->goal_y / 2;
+    coarse->step_reward = fine->step_reward;
+    coarse->goal_reward = fine->goal_reward;
+}
+
+#define MG_MAX_LEVELS 16
+
+static ViStats vi_solve(const DetMdp *mdp, float *V, const Env *env, int method,
+                        float tol, int max_sweeps, int threads){
+    if (method == VI_RED_BLACK)
+        return value_iteration_rb(mdp, V, env->w, env->h, tol, max_sweeps, threads);
+    return value_iteration(mdp, V, method, tol, max_sweeps);
+}
+
+// Multigrid value iteration. Level k is the grid coarsened k times; one coarse
+// move stands for two moves of the level below, so its step reward is
+// r*(1+gamma) and its discount gamma^2. The coarsest level is solved from
+// zero, and each solution is copied down to the 2x2 children as the next
+// level's warm start, so the fine sweeps only have to fix local detail
+// instead of carrying values across the whole grid one cell per sweep.
+ViStats value_iteration_multigrid(const Env *env, float gamma, float *V, int levels,
+                                  int method, float tol, int max_sweeps, int threads){
+    Env lv[MG_MAX_LEVELS];
+    float g[MG_MAX_LEVELS], step[MG_MAX_LEVELS];
+    int n = 1;
+    lv[0] = *env;
+    g[0] = gamma; step[0] = env->step_reward;
+    while (n <= levels && n < MG_MAX_LEVELS && lv[n-1].w >= 4 && lv[n-1].h >= 4){
+        env_coarsen(&lv[n-1], &lv[n]);
+        step[n] = step[n-1] * (1.0f + g[n-1]);
+        g[n] = g[n-1] * g[n-1];
+        lv[n].step_reward = step[n];
+        n++;
+    }
+    ViStats total = { 0, 0.0f, 0.0 };
+    float *Vc = NULL;
+    for (int k=n-1; k>=0; --k){
+        DetMdp mdp;
+        mdp_from_env(&mdp, &lv[k], g[k]);
+        float *Vk = k==0 ? V : (float*)malloc(sizeof(float) * ((size_t)mdp.S + 1));
+        if (!Vk){ fprintf(stderr, "OOM\n"); exit(1); }
+        if (Vc){
+            int cw = lv[k+1].w;
+            for (int y=0; y<lv[k].h; ++y)
+                for (int x=0; x<lv[k].w; ++x)
+                    Vk[y*lv[k].w + x] = Vc[(y/2)*cw + x/2];
+            free(Vc);
+        } else {
+            memset(Vk, 0, sizeof(float) * ((size_t)mdp.S + 1));
+        }
+        Vk[mdp.S] = 0.0f;
+        ViStats st = vi_solve(&mdp, Vk, &lv[k], method, tol, max_sweeps, threads);
+        printf("  level %d: %dx%d | %d sweeps | %.3fs\n", k, lv[k].w, lv[k].h,
+               st.sweeps, st.seconds);
+        total.seconds += st.seconds;
+        if (k==0){ total.sweeps = st.sweeps; total.delta = st.delta; }
+        mdp_free(&mdp);
+        if (k>0) env_free(&lv[k]);
+        Vc = Vk;
+    }
+    return total;
+}
+
+// Convergence and scaling table: serial Jacobi and Gauss-Seidel, then
+// red-black at 1, 2, 4, ... threads up to max_threads.
+void bench_vi(const Env *env, float gamma, float tol, int max_sweeps, int max_threads){
+    DetMdp mdp;
+    mdp_from_env(&mdp, env, gamma);
+    float *V = (float*)malloc(sizeof(float) * ((size_t)mdp.S + 1));
+    if (!V){ fprintf(stderr, "OOM\n"); exit(1); }
+    printf("Value iteration on %dx%d, gamma=%.4f, tol=%g\n", env->w, env->h, gamma, tol);
+    printf("%-14s %7s %8s %10s %9s\n", "method", "threads", "sweeps", "seconds", "speedup");
+    double base = 0.0;
+    for (int method=VI_JACOBI; method<=VI_GAUSS_SEIDEL; ++method){
+        memset(V, 0, sizeof(float) * ((size_t)mdp.S + 1));
+        ViStats st = value_iteration(&mdp, V, method, tol, max_sweeps);
+        if (method==VI_GAUSS_SEIDEL) base = st.seconds;
+        printf("%-14s %7d %8d %10.3f %9s\n", method==VI_JACOBI ? "jacobi" : "gauss-seidel",
+               1, st.sweeps, st.seconds, "-");
+    }
+    for (int t=1;; t = t*2 < max_threads ? t*2 : max_threads){
+        memset(V, 0, sizeof(float) * ((size_t)mdp.S + 1));
+        ViStats st = value_iteration_rb(&mdp, V, env->w, env->h, tol, max_sweeps, t);
+        printf("%-14s %7d %8d %10.3f %8.2fx\n", "red-black", t, st.sweeps, st.seconds,
+               st.seconds>0 ? base / st.seconds : 0.0);
+        if (t >= max_threads) break;
+    }
+    free(V);
+    mdp_free(&mdp);
+}
+
+// Q(s,a) = r(s,a) + gamma * V(nxt(s,a)) for active states, 0 elsewhere.
+void qmodel_from_values(QModel *m, const Env *env, const DetMdp *mdp, const float *V){
+    for (int s=0; s<mdp->S; ++s){
+        for (int a=0; a<ACTIONS; ++a){
+            int ns = mdp->nxt[s*ACTIONS + a];
+            float r = ns==mdp->S ? mdp->goal_reward : mdp->step_reward;
+            m->q[idxQ(env, s, a)] = mdp->active[s] ? r + mdp->gamma * V[ns] : 0.0f;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Q-table initialisation. Zero Q makes early episodes long random walks; an
+// optimistic or distance-shaped start pulls the first greedy moves goalward.
+// ---------------------------------------------------------------------------
+
+#define QINIT_ZERO 0
+#define QINIT_CONST 1
+#define QINIT_MANHATTAN 2
+#define QINIT_COARSE 3
+
+// Discounted return of walking d moves to the goal: d-1 steps then the goal.
+static float value_at_distance(const Env *env, float gamma, float d){
+    if (d <= 0.0f) return 0.0f;
+    float gd = powf(gamma, d - 1.0f);
+    float steps = gamma < 1.0f ? (1.0f - gd) / (1.0f - gamma) : d - 1.0f;
+    return env->step_reward * steps + gd * env->goal_reward;
+}
+
+// Inverse of value_at_distance (d >= 1).
+static float distance_at_value(const Env *env, float gamma, float v){
+    if (gamma >= 1.0f) return fmaxf(1.0f, 1.0f + (v - env->goal_reward) / env->step_reward);
+    float inf = env->step_reward / (1.0f - gamma);   // value of never arriving
+    float x = (v - inf) / (env->goal_reward - inf);   // gamma^(d-1)
+    if (x >= 1.0f) return 1.0f;
+    if (x <= 0.0f) return (float)(MAX_W + MAX_H);
+    return 1.0f + logf(x) / logf(gamma);
+}
+
+// Q(s,a) = r + gamma*V_h(s'), with s' the cell the move aims at (walls are not
+// consulted, so this stays a heuristic) and V_h from an estimated distance:
+//   QINIT_MANHATTAN  |dx| + |dy| to the goal
+//   QINIT_COARSE     max(Manhattan, 2^levels * BFS distance on a grid
+//                    coarsened `levels` times), which sees large walls cheaply
+// The coarse estimate is not a lower bound: a coarse step can cost fewer than
+// 2^levels fine moves, so it may overestimate the distance and start a state
+// below its true value. It is a shaping heuristic, not an optimistic init.
+void qmodel_init(QModel *m, const Env *env, int mode, float value, int levels, float gamma){
+    int S = env->w * env->h;
+    if (mode == QINIT_ZERO || mode == QINIT_CONST){
+        for (int s=0; s<S; ++s)
+            for (int a=0; a<ACTIONS; ++a) m->q[idxQ(env, s, a)] = mode==QINIT_CONST ? value : 0.0f;
+        return;
+    }
+    Env lv[MG_MAX_LEVELS];
+    int *cdist = NULL, n = 0, scale = 1;
+    if (mode == QINIT_COARSE){
+        lv[0] = *env;
+        while (n < levels && n+1 < MG_MAX_LEVELS && lv[n].w >= 4 && lv[n].h >= 4){
+            env_coarsen(&lv[n], &lv[n+1]);
+            n++;
+            scale *= 2;
+        }
+        cdist = (int*)malloc(sizeof(int) * (size_t)lv[n].w * (size_t)lv[n].h);
+        if (!cdist){ fprintf(stderr, "OOM\n"); exit(1); }
+        env_goal_distances(&lv[n], cdist, 0);
+    }
+    static const int dx[ACTIONS] = { 0, 1, 0, -1 }, dy[ACTIONS] = { -1, 0, 1, 0 };
+    for (int s=0; s<S; ++s){
+        int x = s % env->w, y = s / env->w;
+        for (int a=0; a<ACTIONS; ++a){
+            int nx = clamp(x + dx[a], 0, env->w-1), ny = clamp(y + dy[a], 0, env->h-1);
+            int d = abs(nx - env->goal_x) + abs(ny - env->goal_y);
+            if (cdist){
+                int c = cdist[(ny/scale) * lv[n].w + nx/scale];
+                if (c >= 0 && c*scale > d) d = c*scale;
+            }
+            float r = d==0 ? env->goal_reward : env->step_reward;
+            m->q[idxQ(env, s, a)] = r + (d==0 ? 0.0f : gamma * value_at_distance(env, gamma, (float)d));
+        }
+    }
+    for (int k=1; k<=n; ++k) env_free(&lv[k]);
+    free(cdist);
+}
+
+static TrainResult bench_train_init(Env *env, QModel *m, const BenchVariant *v){
+    qmodel_init(m, env, v->mode, v->value, v->levels, v->cfg.gamma);
+    return train(env, m, &v->cfg);
+}
+
+// Episodes, environment steps and time until the greedy policy is optimal,
+// for each initialisation mode, all from the same seed.
+void bench_init(Env *env, const TrainConfig *base, unsigned seed, float opt_value, int levels){
+    static const char *names[] = { "zero", "const", "manhattan", "coarse" };
+    BenchVariant v[4];
+    for (int mode=QINIT_ZERO; mode<=QINIT_COARSE; ++mode){
+        v[mode] = bench_variant(base, names[mode]);
+        v[mode].train = bench_train_init;
+        v[mode].mode = mode;
+        v[mode].value = opt_value;
+        v[mode].levels = levels;
+    }
+    bench_run(env, v, 4, seed, "Q-table initialisation", "init");
+}
+
+// ---------------------------------------------------------------------------
+// Curriculum over grid resolutions: train on the map coarsened L times, then
+// upsample the Q-table to the next finer grid and keep training, up to the
+// full map. Levels use the multigrid scaling (step reward r*(1+gamma),
+// discount gamma^2 per level), so coarse Q-values are already in
+// full-resolution units.
+// ---------------------------------------------------------------------------
+
+#define UPSAMPLE_NEAREST  0
+#define UPSAMPLE_BILINEAR 1
+
+// A row that is still all zero (a wall, the goal, or never updated) carries
+// no information, so bilinear interpolation gives it no weight.
+static int q_row_known(const QModel *m, int s){
+    const float *row = &m->q[(size_t)s * ACTIONS];
+    for (int a=0; a<ACTIONS; ++a) if (row[a] != 0.0f) return 1;
+    return 0;
+}
+
+// Resample src onto dst's (larger) grid. dst must already be allocated.
+// Nearest copies each cell's row from the source cell covering it; bilinear
+// blends the four nearest known source rows per action, and falls back to
+// nearest where none of them is known.
+void qmodel_resample(const QModel *src, QModel *dst, int mode){
+    float fx = (float)src->w / (float)dst->w, fy = (float)src->h / (float)dst->h;
+    for (int y=0; y<dst->h; ++y){
+        for (int x=0; x<dst->w; ++x){
+            float *out = &dst->q[((size_t)y * dst->w + x) * ACTIONS];
+            int nx = clamp((int)((float)x * fx), 0, src->w-1);
+            int ny = clamp((int)((float)y * fy), 0, src->h-1);
+            const float *near = &src->q[((size_t)ny * src->w + nx) * ACTIONS];
+            if (mode == UPSAMPLE_BILINEAR){
+                // Source coordinates of the cell centre
+                float sx = ((float)x + 0.5f) * fx - 0.5f, sy = ((float)y + 0.5f) * fy - 0.5f;
+                int x0 = (int)floorf(sx), y0 = (int)floorf(sy);
+                float tx = sx - (float)x0, ty = sy - (float)y0;
+                float acc[ACTIONS] = { 0 }, wsum = 0.0f;
+                for (int k=0; k<4; ++k){
+                    int cx = clamp(x0 + (k & 1), 0, src->w-1), cy = clamp(y0 + (k >> 1), 0, src->h-1);
+                    float wgt = ((k & 1) ? tx : 1.0f - tx) * ((k >> 1) ? ty : 1.0f - ty);
+                    int cs = cy * src->w + cx;
+                    if (wgt <= 0.0f || !q_row_known(src, cs)) continue;
+                    for (int a=0; a<ACTIONS; ++a) acc[a] += wgt * src->q[(size_t)cs * ACTIONS + a];
+                    wsum += wgt;
+                }
+                if (wsum > 0.0f){
+                    for (int a=0; a<ACTIONS; ++a) out[a] = acc[a] / wsum;
+                    continue;
+                }
+            }
+            memcpy(out, near, sizeof(float) * ACTIONS);
+        }
+    }
+}
+
+// A table learned on a grid `factor` times smaller values every state as if
+// the goal were `factor` times closer. Map each known entry to its distance
+// and back at `factor` times that distance; this is monotone, so greedy
+// actions are unchanged.
+void qmodel_rescale_distance(QModel *m, const Env *env, float gamma, float factor){
+    size_t n = (size_t)m->w * (size_t)m->h * ACTIONS;
+    for (size_t i=0; i<n; ++i){
+        if (m->q[i] == 0.0f) continue;
+        m->q[i] = value_at_distance(env, gamma, factor * distance_at_value(env, gamma, m->q[i]));
+    }
+}
+
+// Train level by level from the coarsest; every level but the last runs until
+// its greedy policy is optimal from the start (capped by cfg->episodes), and
+// the last level is the ordinary run on the full map with cfg as given.
+// Returns the totals over all levels.
+TrainResult train_curriculum(Env *env, QModel *m, const TrainConfig *cfg, int levels, int upsample){
+    Env lv[MG_MAX_LEVELS];
+    float g[MG_MAX_LEVELS];
+    int n = 1;
+    lv[0] = *env;
+    g[0] = cfg->gamma;
+    while (n <= levels && n < MG_MAX_LEVELS && lv[n-1].w >= 4 && lv[n-1].h >= 4){
+        env_coarsen(&lv[n-1], &lv[n]);
+        lv[n].step_reward = lv[n-1].step_reward * (1.0f + g[n-1]);
+        g[n] = g[n-1] * g[n-1];
+        n++;
+    }
+    TrainResult total = { 0, 0, 0, 0, 0, 0.0 };
+    QModel prev = { 0, 0, NULL, NULL, 0 };
+    for (int k=n-1; k>=0; --k){
+        QModel cur;
+        if (k > 0) qmodel_alloc(&cur, lv[k].w, lv[k].h);
+        else cur = *m;
+        if (prev.q){
+            qmodel_resample(&prev, &cur, upsample);
+            qmodel_free(&prev);
+        }
+        TrainConfig c = *cfg;
+        int *dist = NULL;
+        if (k > 0){
+            dist = (int*)malloc(sizeof(int) * (size_t)lv[k].w * (size_t)lv[k].h);
+            if (!dist){ fprintf(stderr, "OOM\n"); exit(1); }
+            env_goal_distances(&lv[k], dist, 0);
+            c.gamma = g[k];
+            c.dist = dist;
+            if (c.check_every <= 0) c.check_every = 10;
+            c.max_seconds = 0.0; c.max_steps = 0;
+            c.render_every = 0;
+        }
+        printf("Curriculum level %d: %dx%d\n", k, lv[k].w, lv[k].h);
+        TrainResult r = train(&lv[k], &cur, &c);
+        printf("  %d episodes, %lld steps, %lld updates, %.3fs%s\n", r.episodes, r.steps,
+               r.updates, r.seconds, r.optimal ? " (optimal)" : "");
+        total.episodes += r.episodes; total.steps += r.steps;
+        total.updates += r.updates; total.seconds += r.seconds;
+        total.optimal = r.optimal; total.budget = r.budget;
+        free(dist);
+        if (k > 0){
+            prev = cur;
+            env_free(&lv[k]);
+        }
+    }
+    return total;
+}
+
+static TrainResult bench_train_curriculum(Env *env, QModel *m, const BenchVariant *v){
+    return train_curriculum(env, m, &v->cfg, v->levels, v->mode);
+}
+
+// Compute to reach an optimal greedy policy from the start: training directly
+// on the full map vs the curriculum with each upsampling mode.
+void bench_curriculum(Env *env, const TrainConfig *base, unsigned seed, int levels){
+    static const char *names[] = { "direct", "nearest", "bilinear" };
+    if (levels <= 0) levels = 2;
+    BenchVariant v[3];
+    for (int i=0; i<3; ++i){
+        v[i] = bench_variant(base, names[i]);
+        if (i){
+            v[i].train = bench_train_curriculum;
+            v[i].mode = i == 1 ? UPSAMPLE_NEAREST : UPSAMPLE_BILINEAR;
+            v[i].levels = levels;
+        }
+    }
+    char title[64];
+    snprintf(title, sizeof(title), "Curriculum (%d levels) vs direct training", levels);
+    bench_run(env, v, 3, seed, title, "training");
+}
+
+// ---------------------------------------------------------------------------
+// Corridor contraction. A free cell with exactly two free neighbours is a
+// corridor cell: the only sensible moves are along the corridor. Every other
+// free cell (junction, dead end, room cell) plus start and goal becomes a node,
+// and each chain of corridor cells becomes one macro-transition between two
+// nodes with its summed discounted reward and discount gamma^len. Q-learning
+// (SMDP) and value iteration then run on the junction graph, and the result is
+// expanded back to a per-cell Q-table.
+// ---------------------------------------------------------------------------
+
+static const int dir_dx[ACTIONS] = { 0, 1, 0, -1 }, dir_dy[ACTIONS] = { -1, 0, 1, 0 };
+
+// Free neighbour of cell s in direction a, or -1.
+static inline int cell_neighbour(const Env *env, int s, int a){
+    int x = s % env->w + dir_dx[a], y = s / env->w + dir_dy[a];
+    return env_valid(env, x, y) ? y * env->w + x : -1;
+}
+
+typedef struct {
+    int n;                  // nodes
+    int edges;              // valid (node, action) macro-transitions
+    int start, goal;        // node ids
+    int *cell;              // [n] node -> cell
+    int *node_of;           // [S] cell -> node, -1 for corridor cells and walls
+    int *next;              // [n*A] target node, -1 if the move is blocked
+    int *len;               // [n*A] primitive moves
+    float *reward;          // [n*A] sum of gamma^k r_k along the corridor
+    float *disc;            // [n*A] gamma^len
+    int *path;              // walk scratch: corridor cells passed
+    unsigned char *dirs;    // walk scratch: move taken out of each of them
+} JunctionGraph;
+
+// Follow the corridor that leaves cell c by action a up to the next node.
+// Returns that node (-1 for a wall, or a corridor that loops without one) and
+// the number of moves in *len; g->path/g->dirs receive the corridor cells
+// passed and the move taken out of each.
+static int corridor_walk(JunctionGraph *g, const Env *env, int c, int a, int *len){
+    int prev = c, cur = cell_neighbour(env, c, a), k = 0, S = env->w * env->h;
+    if (cur < 0) return -1;
+    while (g->node_of[cur] < 0){
+        if (k == S) return -1;
+        int d = 0, nb = -1;
+        for (; d<ACTIONS; ++d){
+            nb = cell_neighbour(env, cur, d);
+            if (nb >= 0 && nb != prev) break;
+        }
+        g->path[k] = cur; g->dirs[k] = (unsigned char)d; k++;
+        prev = cur; cur = nb;
+    }
+    *len = k + 1;
+    return g->node_of[cur];
+}
+
+// Discounted reward of m moves that end at the goal or at an ordinary cell.
+static float corridor_reward(const Env *env, float gamma, int m, int to_goal){
+    if (to_goal) return value_at_distance(env, gamma, (float)m);
+    return gamma < 1.0f ? env->step_reward * (1.0f - powf(gamma, (float)m)) / (1.0f - gamma)
+                        : env->step_reward * (float)m;
+}
+
+void jgraph_build(JunctionGraph *g, const Env *env, float gamma){
+    int S = env->w * env->h;
+    int start = state_id(env, env->start_x, env->start_y);
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    g->node_of = (int*)malloc(sizeof(int) * (size_t)S);
+    g->cell = (int*)malloc(sizeof(int) * (size_t)S);
+    g->path = (int*)malloc(sizeof(int) * (size_t)S);
+    g->dirs = (unsigned char*)malloc((size_t)S);
+    if (!g->node_of || !g->cell || !g->path || !g->dirs){ fprintf(stderr, "OOM\n"); exit(1); }
+    g->n = 0;
+    for (int s=0; s<S; ++s){
+        g->node_of[s] = -1;
+        if (env->walls[s]) continue;
+        int deg = 0;
+        for (int a=0; a<ACTIONS; ++a) deg += cell_neighbour(env, s, a) >= 0;
+        if (deg != 2 || s == start || s == goal){
+            g->node_of[s] = g->n;
+            g->cell[g->n++] = s;
+        }
+    }
+    g->start = g->node_of[start]; g->goal = g->node_of[goal];
+    size_t na = (size_t)g->n * ACTIONS;
+    g->next = (int*)malloc(sizeof(int) * na);
+    g->len = (int*)malloc(sizeof(int) * na);
+    g->reward = (float*)malloc(sizeof(float) * na);
+    g->disc = (float*)malloc(sizeof(float) * na);
+    if (!g->next || !g->len || !g->reward || !g->disc){ fprintf(stderr, "OOM\n"); exit(1); }
+    g->edges = 0;
+    for (int i=0; i<g->n; ++i){
+        for (int a=0; a<ACTIONS; ++a){
+            int e = i*ACTIONS + a, L = 0;
+            int to = i == g->goal ? -1 : corridor_walk(g, env, g->cell[i], a, &L);
+            g->next[e] = to;
+            if (to < 0) continue;
+            g->len[e] = L;
+            g->reward[e] = corridor_reward(env, gamma, L, to == g->goal);
+            g->disc[e] = powf(gamma, (float)L);
+            g->edges++;
+        }
+    }
+}
+
+void jgraph_free(JunctionGraph *g){
+    free(g->node_of); free(g->cell); free(g->path); free(g->dirs);
+    free(g->next); free(g->len); free(g->reward); free(g->disc);
+}
+
+// Best Q over the moves that are not blocked (0 at the goal or with none).
+static inline float jgraph_value(const JunctionGraph *g, const float *Q, int i){
+    if (i == g->goal) return 0.0f;
+    float v = -INFINITY;
+    for (int a=0; a<ACTIONS; ++a)
+        if (g->next[i*ACTIONS + a] >= 0 && Q[i*ACTIONS + a] > v) v = Q[i*ACTIONS + a];
+    return v == -INFINITY ? 0.0f : v;
+}
+
+static inline float jgraph_target(const JunctionGraph *g, const float *Q, int e){
+    return g->reward[e] + g->disc[e] * jgraph_value(g, Q, g->next[e]);
+}
+
+// Gauss-Seidel value iteration on the junction graph, same stopping rule as
+// value_iteration.
+ViStats jgraph_value_iteration(const JunctionGraph *g, float *Q, float gamma, float tol,
+                               int max_sweeps){
+    float stop = gamma < 1.0f ? tol * (1.0f - gamma) / gamma : tol;
+    ViStats st = { 0, INFINITY, 0.0 };
+    double t0 = now_sec();
+    while (st.sweeps < max_sweeps && st.delta >= stop){
+        float delta = 0.0f;
+        for (int e=0; e<g->n*ACTIONS; ++e){
+            if (g->next[e] < 0) continue;
+            float q = jgraph_target(g, Q, e);
+            delta = fmaxf(delta, fabsf(q - Q[e]));
+            Q[e] = q;
+        }
+        st.delta = delta;
+        st.sweeps++;
+    }
+    st.seconds = now_sec() - t0;
+    return st;
+}
+
+// Per-cell Q from node values. A node's value is its best graph Q; a corridor
+// cell's value is the better of its two directions, where heading for node B
+// m moves away is worth the discounted corridor reward plus gamma^m V(B).
+// Then Q(s,a) = r + gamma V(s') for the cell s' the move reaches (s itself if
+// blocked), so a converged graph solution expands to the exact per-cell Q.
+void jgraph_expand(JunctionGraph *g, const float *Q, const Env *env, float gamma, QModel *m){
+    int S = env->w * env->h;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    float *V = (float*)malloc(sizeof(float) * (size_t)S);
+    if (!V){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int s=0; s<S; ++s) V[s] = -INFINITY;
+    for (int i=0; i<g->n; ++i){
+        V[g->cell[i]] = jgraph_value(g, Q, i);
+        for (int a=0; a<ACTIONS; ++a){
+            int L;
+            if (g->next[i*ACTIONS + a] < 0) continue;
+            int to = corridor_walk(g, env, g->cell[i], a, &L);
+            float vb = jgraph_value(g, Q, to);
+            for (int k=0; k<L-1; ++k){
+                int rem = L-1-k;
+                float v = corridor_reward(env, gamma, rem, to == g->goal) + powf(gamma, (float)rem) * vb;
+                if (v > V[g->path[k]]) V[g->path[k]] = v;
+            }
+        }
+    }
+    for (int s=0; s<S; ++s){
+        for (int a=0; a<ACTIONS; ++a){
+            float *q = &m->q[idxQ(env, s, a)];
+            if (s == goal || V[s] == -INFINITY){ *q = 0.0f; continue; }   // goal, walls, node-less loops
+            int ns = cell_neighbour(env, s, a);
+            if (ns < 0) ns = s;
+            *q = ns == goal ? env->goal_reward : env->step_reward + gamma * V[ns];
+        }
+    }
+    free(V);
+}
+
+// SMDP Q-learning on the junction graph: each decision picks a move at a node
+// and jumps to the next node, updating toward R + gamma^len * max Q(next).
+// steps counts primitive moves and updates counts decisions.
+TrainResult train_contracted(Env *env, QModel *m, const TrainConfig *cfg){
+    JunctionGraph g;
+    jgraph_build(&g, env, cfg->gamma);
+    int free_cells = 0;
+    for (int s=0; s<env->w*env->h; ++s) free_cells += !env->walls[s];
+    printf("Junction graph: %d nodes (%.1f%% of %d free cells), %d macro-transitions\n",
+           g.n, free_cells ? 100.0 * g.n / free_cells : 0.0, free_cells, g.edges);
+    float *Q = (float*)calloc((size_t)g.n * ACTIONS, sizeof(float));
+    if (!Q){ fprintf(stderr, "OOM\n"); exit(1); }
+    TrainResult res = { 0, 0, 0, 0, 0, 0.0 };
+    int unbounded = cfg->episodes <= 0 && (cfg->max_seconds > 0.0 || cfg->max_steps > 0
+                                           || (cfg->check_every > 0 && cfg->dist));
+    Rng rng = { (uint64_t)rand() };   // seeded like train()
+    double t0 = now_sec();
+    for (int ep=1; (unbounded || ep<=cfg->episodes) && g.start != g.goal; ++ep){
+        float eps = fmaxf(cfg->eps_min, cfg->eps_start * expf(-cfg->eps_decay * (float)ep));
+        int node = g.start, steps = 0;
+        while (node != g.goal && steps < env->step_limit){
+            int valid[ACTIONS], nv = 0, best = -1;
+            for (int a=0; a<ACTIONS; ++a){
+                int e = node*ACTIONS + a;
+                if (g.next[e] < 0) continue;
+                valid[nv++] = a;
+                if (best < 0 || Q[e] > Q[node*ACTIONS + best]) best = a;
+            }
+            if (nv == 0) break;
+            int a = rng_float(&rng) < eps ? valid[rng_int(&rng, nv)] : best;
+            int e = node*ACTIONS + a;
+            Q[e] += cfg->alpha * (jgraph_target(&g, Q, e) - Q[e]);
+            res.updates++;
+            steps += g.len[e];
+            node = g.next[e];
+            if ((cfg->max_steps > 0 && res.steps + steps >= cfg->max_steps)
+                || (cfg->max_seconds > 0.0 && (res.updates & (CLOCK_CHECK_STEPS-1)) == 0
+                    && now_sec() - t0 >= cfg->max_seconds)){
+                res.budget = 1;
+                break;
+            }
+        }
+        res.episodes = ep;
+        res.steps += steps;
+        if (cfg->check_every>0 && cfg->dist && ep % cfg->check_every == 0){
+            jgraph_expand(&g, Q, env, cfg->gamma, m);
+            int opt = cfg->check_all ? policy_suboptimal_states(env, m, cfg->dist)==0
+                                     : policy_optimal_from_start(env, m, cfg->dist);
+            if (opt){
+                printf("Greedy policy optimal%s after %d episodes (%lld steps, %lld decisions)\n",
+                       cfg->check_all ? " from all states" : " from start", ep, res.steps,
+                       res.updates);
+                res.optimal = 1;
+                break;
+            }
+        }
+        if (res.budget) break;
+    }
+    res.seconds = now_sec() - t0;
+    jgraph_expand(&g, Q, env, cfg->gamma, m);
+    free(Q);
+    jgraph_free(&g);
+    return res;
+}
+
+static TrainResult bench_train_contracted(Env *env, QModel *m, const BenchVariant *v){
+    return train_contracted(env, m, &v->cfg);
+}
+
+// Per-cell Q-learning vs SMDP Q-learning on the junction graph until the
+// greedy policy is optimal, then per-cell vs graph value iteration.
+void bench_contract(Env *env, const TrainConfig *base, unsigned seed, float tol){
+    BenchVariant v[2] = { bench_variant(base, "per-cell"), bench_variant(base, "contracted") };
+    v[1].train = bench_train_contracted;
+    bench_run(env, v, 2, seed, "Corridor contraction", "training");
+    const TrainConfig cfg = v[0].cfg;
+
+    DetMdp mdp;
+    mdp_from_env(&mdp, env, cfg.gamma);
+    float *V = (float*)calloc((size_t)mdp.S + 1, sizeof(float));
+    if (!V){ fprintf(stderr, "OOM\n"); exit(1); }
+    ViStats cell = value_iteration(&mdp, V, VI_GAUSS_SEIDEL, tol, 1000000);
+    free(V);
+    mdp_free(&mdp);
+    JunctionGraph g;
+    jgraph_build(&g, env, cfg.gamma);
+    float *Q = (float*)calloc((size_t)g.n * ACTIONS, sizeof(float));
+    if (!Q){ fprintf(stderr, "OOM\n"); exit(1); }
+    ViStats graph = jgraph_value_iteration(&g, Q, cfg.gamma, tol, 1000000);
+    printf("%-10s %9s %9s\n", "VI", "sweeps", "seconds");
+    printf("%-10s %9d %9.3f\n", "per-cell", cell.sweeps, cell.seconds);
+    printf("%-10s %9d %9.3f\n", "graph", graph.sweeps, graph.seconds);
+    free(Q);
+    jgraph_free(&g);
+}
+
+// ---------------------------------------------------------------------------
+// Options (macro-actions) learned with SMDP Q-learning. A free cell offers
+//   run(d)       move in direction d and follow the corridor to the next
+//                junction-graph node (a single move if the neighbour is one)
+//   room->door   shortest path inside the cell's room to one of its doorways
+//                (or to the goal, if the goal is in the room)
+// Primitive moves are not options of their own: a shortest path never stops
+// inside a corridor or walks into a wall, so run(d) covers every move it makes.
+// Rooms come from the wall layout: a room cell lies in some 2x2 block of free
+// cells, and a room is a connected region of room cells, so 1-wide corridors
+// and wall gaps belong to no room. A doorway of a room is a free cell outside
+// it, next to one of its cells, that leads somewhere else: it has a free
+// neighbour that is not in the room (the next corridor cell, or another room
+// behind a gap). Dead-end nooks and cut corners are not doorways, and a
+// corridor's interior is left to run(d). Every option's outcome is
+// deterministic, so termination cell, length and discounted reward are
+// precomputed into a per-cell (CSR) table.
+// ---------------------------------------------------------------------------
+
+#define OPT_RUN  0
+#define OPT_ROOM 1
+#define OPT_ROOM_MIN   4   // smaller rooms get no room->door options
+#define OPT_MAX_DOORS  8   // targets per room
+
+typedef struct {
+    int *start;             // [S+1] options of cell s are start[s] .. start[s+1]-1
+    int *end, *len;         // termination cell and primitive moves
+    float *reward, *disc;   // discounted reward on the way, gamma^len
+    unsigned char *first;   // first primitive move
+    unsigned char *kind;    // OPT_*
+    int total, rooms, doors;
+} OptionSet;
+
+typedef struct { int cell, end, len; unsigned char first, kind; } OptRecord;
+
+typedef struct { OptRecord *r; int n, cap; } OptList;
+
+static void optlist_push(OptList *l, int cell, int end, int len, int first, int kind){
+    if (l->n == l->cap){
+        l->cap = l->cap ? l->cap*2 : 1024;
+        l->r = (OptRecord*)realloc(l->r, sizeof(OptRecord) * (size_t)l->cap);
+        if (!l->r){ fprintf(stderr, "OOM\n"); exit(1); }
+    }
+    l->r[l->n++] = (OptRecord){ cell, end, len, (unsigned char)first, (unsigned char)kind };
+}
+
+void options_build(OptionSet *o, const Env *env, float gamma){
+    int S = env->w * env->h;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    OptList l = { NULL, 0, 0 };
+
+    // Runs along corridors
+    JunctionGraph g;
+    jgraph_build(&g, env, gamma);
+    for (int s=0; s<S; ++s){
+        if (env->walls[s] || s == goal) continue;
+        for (int a=0; a<ACTIONS; ++a){
+            int L, to = cell_neighbour(env, s, a) < 0 ? -1 : corridor_walk(&g, env, s, a, &L);
+            if (to >= 0) optlist_push(&l, s, g.cell[to], L, a, OPT_RUN);
+        }
+    }
+    jgraph_free(&g);
+
+    // Rooms and their doorways
+    unsigned char *door = (unsigned char*)calloc((size_t)S, 1);
+    int *room = (int*)malloc(sizeof(int) * (size_t)S);
+    int *queue = (int*)malloc(sizeof(int) * (size_t)S);
+    int *bfs = (int*)malloc(sizeof(int) * (size_t)S);
+    int *dist = (int*)malloc(sizeof(int) * (size_t)S);
+    unsigned char *first = (unsigned char*)malloc((size_t)S);
+    if (!door || !room || !queue || !bfs || !dist || !first){ fprintf(stderr, "OOM\n"); exit(1); }
+    // room[s]: -2 = not a room cell, -1 = room cell not yet filled
+    for (int s=0; s<S; ++s){ room[s] = -2; dist[s] = -1; }
+    for (int y=0; y+1<env->h; ++y){
+        for (int x=0; x+1<env->w; ++x){
+            int c = state_id(env, x, y);
+            if (env->walls[c] || env->walls[c+1] || env->walls[c+env->w] || env->walls[c+env->w+1])
+                continue;
+            room[c] = room[c+1] = room[c+env->w] = room[c+env->w+1] = -1;
+        }
+    }
+    o->rooms = 0; o->doors = 0;
+    for (int s0=0; s0<S; ++s0){
+        if (room[s0] != -1) continue;
+        // Flood-fill one room; queue[0..n) ends up holding its cells
+        int r = o->rooms++, n = 0;
+        room[s0] = r; queue[n++] = s0;
+        for (int h=0; h<n; ++h){
+            for (int a=0; a<ACTIONS; ++a){
+                int nb = cell_neighbour(env, queue[h], a);
+                if (nb >= 0 && room[nb] == -1){ room[nb] = r; queue[n++] = nb; }
+            }
+        }
+        int targets[OPT_MAX_DOORS + 1], nt = 0;
+        for (int i=0; i<n && nt<OPT_MAX_DOORS; ++i){
+            if (queue[i] == goal){ targets[nt++] = goal; continue; }
+            for (int a=0; a<ACTIONS && nt<OPT_MAX_DOORS; ++a){
+                int nb = cell_neighbour(env, queue[i], a), dup = 0, leads = 0;
+                if (nb < 0 || room[nb] == r) continue;
+                for (int b=0; b<ACTIONS; ++b){
+                    int out = cell_neighbour(env, nb, b);
+                    leads |= out >= 0 && room[out] != r;
+                }
+                if (!leads && nb != goal) continue;
+                for (int k=0; k<nt; ++k) dup |= targets[k] == nb;
+                if (dup) continue;
+                targets[nt++] = nb;
+                if (!door[nb]){ door[nb] = 1; o->doors++; }
+            }
+        }
+        if (n < OPT_ROOM_MIN) continue;
+        // BFS from each target through this room only; the goal is never
+        // crossed on the way to another target
+        for (int k=0; k<nt; ++k){
+            int t = targets[k], m = 0;
+            dist[t] = 0; bfs[m++] = t;
+            for (int h=0; h<m; ++h){
+                int u = bfs[h];
+                if (u == goal && u != t) continue;
+                for (int a=0; a<ACTIONS; ++a){
+                    int nb = cell_neighbour(env, u, a);
+                    if (nb < 0 || room[nb] != r || dist[nb] >= 0) continue;
+                    dist[nb] = dist[u] + 1;
+                    first[nb] = (unsigned char)((a + 2) % ACTIONS);   // step back toward u
+                    bfs[m++] = nb;
+                }
+            }
+            for (int h=0; h<m; ++h){
+                int c = bfs[h];
+                if (dist[c] > 1 && c != goal) optlist_push(&l, c, t, dist[c], first[c], OPT_ROOM);
+                dist[c] = -1;
+            }
+        }
+    }
+    free(door); free(room); free(queue); free(bfs); free(dist); free(first);
+
+    // Counting sort by cell into the CSR table
+    o->total = l.n;
+    o->start = (int*)calloc((size_t)S + 1, sizeof(int));
+    o->end = (int*)malloc(sizeof(int) * (size_t)l.n);
+    o->len = (int*)malloc(sizeof(int) * (size_t)l.n);
+    o->reward = (float*)malloc(sizeof(float) * (size_t)l.n);
+    o->disc = (float*)malloc(sizeof(float) * (size_t)l.n);
+    o->first = (unsigned char*)malloc((size_t)l.n);
+    o->kind = (unsigned char*)malloc((size_t)l.n);
+    if (!o->start || !o->end || !o->len || !o->reward || !o->disc || !o->first || !o->kind){
+        fprintf(stderr, "OOM\n"); exit(1);
+    }
+    for (int i=0; i<l.n; ++i) o->start[l.r[i].cell + 1]++;
+    for (int s=0; s<S; ++s) o->start[s+1] += o->start[s];
+    int *fill = (int*)malloc(sizeof(int) * (size_t)S);
+    if (!fill){ fprintf(stderr, "OOM\n"); exit(1); }
+    memcpy(fill, o->start, sizeof(int) * (size_t)S);
+    for (int i=0; i<l.n; ++i){
+        const OptRecord *r = &l.r[i];
+        int j = fill[r->cell]++;
+        o->end[j] = r->end; o->len[j] = r->len;
+        o->reward[j] = corridor_reward(env, gamma, r->len, r->end == goal);
+        o->disc[j] = powf(gamma, (float)r->len);
+        o->first[j] = r->first; o->kind[j] = r->kind;
+    }
+    free(fill);
+    free(l.r);
+}
 
-typedef struct {
-    // Q-table dims: (h*w) x ACTIONS
-    int w, h;
-    float *q; // size = w*h*ACTIONS
-} QModel;
+void options_free(OptionSet *o){
+    free(o->start); free(o->end); free(o->len); free(o->reward);
+    free(o->disc); free(o->first); free(o->kind);
+}
 
-static inline int clamp(int v, int lo, int hi){ return v<lo?lo:(v>hi?hi:v); }
-static inline int state_id(const Env *env, int x, int y){ return y*env->w + x; }
-static inline int idxQ(const Env *env, int s, int a){ return s*ACTIONS + a; }
+static inline float options_value(const OptionSet *o, const float *Q, int s){
+    float v = -INFINITY;
+    for (int j=o->start[s]; j<o->start[s+1]; ++j) v = fmaxf(v, Q[j]);
+    return v == -INFINITY ? 0.0f : v;   // goal and walls have no options
+}
 
-void env_init(Env *env, int w, int h) {
-    env->w = w; env->h = h;
-    env->start_x = 0; env->start_y = 0;
-    env->goal_x = w-1; env->goal_y = h-1;
-    memset(env->walls, 0, sizeof(env->walls));
-    // Example obstacles for a small maze; tweak as you like
-    if (w>=5 && h>=5) {
-        env->walls[1][2] = 1;
-        env->walls[2][2] = 1;
-        env->walls[3][2] = 1;
-        env->walls[3][1] = 1;
+static inline int options_greedy(const OptionSet *o, const float *Q, int s){
+    int j = o->start[s];
+    for (int k=j+1; k<o->start[s+1]; ++k) if (Q[k] > Q[j]) j = k;
+    return j;
+}
+
+// Greedy option rollout from s: moves taken, or -1 if it fails to reach the goal
+static long long options_greedy_moves(const OptionSet *o, const float *Q, const Env *env, int s,
+                                      long long *decisions){
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    long long moves = 0;
+    for (int d=0; s != goal; ++d){
+        if (d > env->w * env->h || o->start[s] == o->start[s+1]) return -1;
+        int j = options_greedy(o, Q, s);
+        moves += o->len[j];
+        s = o->end[j];
+        if (decisions) (*decisions)++;
     }
-    env->step_limit = w*h*4;
-    env->step_reward = -1.0f;
-    env->goal_reward = 10.0f;
+    return moves;
 }
 
-int env_valid(const Env *env, int x, int y){
-    if (x<0 || x>=env->w || y<0 || y>=env->h) return 0;
-    if (env->walls[y][x]) return 0;
-    return 1;
+// Next move of option j after stepping from prev into c (-1 if none)
+static int options_next_move(const OptionSet *o, const Env *env, int j, int prev, int c){
+    for (int a=0; a<ACTIONS; ++a){
+        int nb = cell_neighbour(env, c, a);
+        if (nb < 0 || nb == prev) continue;
+        if (o->kind[j] == OPT_RUN || nb == o->end[j]) return a;   // corridor cells have one way on
+    }
+    for (int k=o->start[c]; k<o->start[c+1]; ++k)
+        if (o->kind[k] == OPT_ROOM && o->end[k] == o->end[j]) return o->first[k];
+    return -1;
 }
 
-Pos env_step(const Env *env, Pos s, int action, float *reward, int *done){
-    Pos ns = s;
-    if (action==0) ns.y -= 1;
-    else if (action==1) ns.x += 1;
-    else if (action==2) ns.y += 1;
-    else if (action==3) ns.x -= 1;
+// Primitive Q-table from the greedy option policy pi, as in jgraph_expand:
+// Q(s,a) = r + gamma * V(s'). V(s) starts as V^pi(s), evaluated by following
+// each cell's chain of greedy options (memoized; cells on a cycle of pi get
+// the return of never arriving). Cells inside an option are rarely decision
+// points, so each greedy option is then walked and V raised to the return of
+// finishing it. Every V is the return of a real path, and each path's next
+// cell holds at least the rest of it, so the primitive greedy policy is at
+// least as good as pi from every cell, and optimal wherever pi is. A walk
+// stops at the first cell already holding its value.
+void options_export(const OptionSet *o, const float *Q, const Env *env, QModel *m, float gamma){
+    int S = env->w * env->h;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    float *V = (float*)malloc(sizeof(float) * (size_t)S);
+    int *chain = (int*)malloc(sizeof(int) * (size_t)S);
+    unsigned char *state = (unsigned char*)malloc((size_t)S);   // 0 new, 1 on chain, 2 done
+    if (!V || !chain || !state){ fprintf(stderr, "OOM\n"); exit(1); }
+    float never = gamma < 1.0f ? env->step_reward / (1.0f - gamma) : env->step_reward * (float)S;
+    for (int s=0; s<S; ++s){
+        int none = o->start[s] == o->start[s+1];   // goal and walls
+        V[s] = 0.0f;
+        state[s] = none ? 2 : 0;
+    }
+    for (int s0=0; s0<S; ++s0){
+        int n = 0, c = s0;
+        while (state[c] == 0){
+            state[c] = 1;
+            chain[n++] = c;
+            c = o->end[options_greedy(o, Q, c)];
+        }
+        int cycle = n;   // chain[cycle..n) loops back onto itself
+        if (state[c] == 1) do --cycle; while (chain[cycle] != c);
+        for (int k=n-1; k>=0; --k){
+            int j = options_greedy(o, Q, chain[k]);
+            V[chain[k]] = k >= cycle ? never : o->reward[j] + o->disc[j] * V[o->end[j]];
+            state[chain[k]] = 2;
+        }
+    }
+    for (int s=0; s<S; ++s){
+        if (o->start[s] == o->start[s+1]) continue;
+        int j = options_greedy(o, Q, s), end = o->end[j];
+        int prev = s, c = cell_neighbour(env, s, o->first[j]);
+        for (int i=1; i<o->len[j]; ++i){
+            int rem = o->len[j] - i;
+            float v = corridor_reward(env, gamma, rem, end == goal) + powf(gamma, (float)rem) * V[end];
+            if (V[c] >= v) break;
+            V[c] = v;
+            int a = options_next_move(o, env, j, prev, c);
+            if (a < 0) break;
+            prev = c;
+            c = cell_neighbour(env, c, a);
+        }
+    }
+    for (int s=0; s<S; ++s){
+        for (int a=0; a<ACTIONS; ++a){
+            float *q = &m->q[idxQ(env, s, a)];
+            if (o->start[s] == o->start[s+1]){ *q = 0.0f; continue; }
+            int ns = cell_neighbour(env, s, a);
+            if (ns < 0) ns = s;
+            *q = ns == goal ? env->goal_reward : env->step_reward + gamma * V[ns];
+        }
+    }
+    free(V); free(chain); free(state);
+}
 
-    if (!env_valid(env, ns.x, ns.y)) {
-        // bump into wall/bounds: stay put, small penalty from step_reward
-        ns = s;
+// SMDP Q-learning over options: each decision runs one option to its end
+// cell and updates toward R + gamma^len * max Q(end). steps counts primitive
+// moves and updates counts decisions.
+TrainResult train_options(Env *env, QModel *m, const TrainConfig *cfg){
+    OptionSet o;
+    options_build(&o, env, cfg->gamma);
+    int S = env->w * env->h, free_cells = 0;
+    for (int s=0; s<S; ++s) free_cells += !env->walls[s];
+    printf("Options: %d over %d free cells (%.1f per cell), %d rooms, %d doorways\n",
+           o.total, free_cells, free_cells ? (double)o.total / free_cells : 0.0, o.rooms, o.doors);
+    float *Q = (float*)calloc((size_t)o.total, sizeof(float));
+    if (!Q){ fprintf(stderr, "OOM\n"); exit(1); }
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    TrainResult res = { 0, 0, 0, 0, 0, 0.0 };
+    int unbounded = cfg->episodes <= 0 && (cfg->max_seconds > 0.0 || cfg->max_steps > 0
+                                           || (cfg->check_every > 0 && cfg->dist));
+    Rng rng = { (uint64_t)rand() };   // seeded like train()
+    double t0 = now_sec();
+    for (int ep=1; unbounded || ep<=cfg->episodes; ++ep){
+        float eps = fmaxf(cfg->eps_min, cfg->eps_start * expf(-cfg->eps_decay * (float)ep));
+        int s = state_id(env, env->start_x, env->start_y), steps = 0;
+        while (s != goal && steps < env->step_limit){
+            int lo = o.start[s], n = o.start[s+1] - lo;
+            if (n == 0) break;
+            int j = rng_float(&rng) < eps ? lo + rng_int(&rng, n) : options_greedy(&o, Q, s);
+            int ns = o.end[j];
+            float target = o.reward[j] + (ns == goal ? 0.0f : o.disc[j] * options_value(&o, Q, ns));
+            Q[j] += cfg->alpha * (target - Q[j]);
+            res.updates++;
+            steps += o.len[j];
+            s = ns;
+            if ((cfg->max_steps > 0 && res.steps + steps >= cfg->max_steps)
+                || (cfg->max_seconds > 0.0 && (res.updates & (CLOCK_CHECK_STEPS-1)) == 0
+                    && now_sec() - t0 >= cfg->max_seconds)){
+                res.budget = 1;
+                break;
+            }
+        }
+        res.episodes = ep;
+        res.steps += steps;
+        if (cfg->check_every>0 && cfg->dist && ep % cfg->check_every == 0){
+            // Checked on the options: the exported table does at least as well
+            int opt = 1, s0 = state_id(env, env->start_x, env->start_y);
+            for (int c = cfg->check_all ? 0 : s0; opt && c < (cfg->check_all ? S : s0 + 1); ++c)
+                if (!env->walls[c] && c != goal)
+                    opt = options_greedy_moves(&o, Q, env, c, NULL) == cfg->dist[c];
+            if (opt){
+                printf("Greedy policy optimal%s after %d episodes (%lld steps, %lld decisions)\n",
+                       cfg->check_all ? " from all states" : " from start", ep, res.steps,
+                       res.updates);
+                res.optimal = 1;
+                break;
+            }
+        }
+        if (res.budget) break;
     }
-    *done = (ns.x==env->goal_x && ns.y==env->goal_y);
-    *reward = *done ? env->goal_reward : env->step_reward;
-    return ns;
+    res.seconds = now_sec() - t0;
+    options_export(&o, Q, env, m, cfg->gamma);
+    long long decisions = 0, moves = options_greedy_moves(&o, Q, env,
+                                  state_id(env, env->start_x, env->start_y), &decisions);
+    if (moves >= 0) printf("Greedy options from start: %lld moves in %lld decisions\n", moves, decisions);
+    free(Q);
+    options_free(&o);
+    return res;
 }
 
-void qmodel_alloc(QModel *m, int w, int h) {
-    m->w = w; m->h = h;
-    m->q = (float*)calloc((size_t)(w*h*ACTIONS), sizeof(float));
-    if (!m->q) { fprintf(stderr, "OOM\n"); exit(1); }
+static TrainResult bench_train_options(Env *env, QModel *m, const BenchVariant *v){
+    return train_options(env, m, &v->cfg);
 }
 
-void qmodel_free(QModel *m) {
-    free(m->q); m->q=NULL;
+// Primitive Q-learning vs SMDP Q-learning over options, until optimal.
+// "updates" counts decisions, so upd/step is decisions per primitive step.
+void bench_options(Env *env, const TrainConfig *base, unsigned seed){
+    BenchVariant v[2] = { bench_variant(base, "primitive"), bench_variant(base, "options") };
+    v[1].train = bench_train_options;
+    bench_run(env, v, 2, seed, "Options", "training");
 }
 
-int argmax_a(const QModel *m, const Env *env, int s) {
-    float best = m->q[idxQ(env, s, 0)];
-    int best_a = 0;
-    for (int a=1; a<ACTIONS; ++a){
-        float v = m->q[idxQ(env, s, a)];
-        if (v > best){ best=v; best_a=a; }
+// Full vs symmetry-reduced Q-table, uniform starts, until the greedy policy
+// is optimal from every state.
+void bench_symmetry(Env *env, const TrainConfig *base, unsigned seed){
+    Symmetry sy;
+    if (!symmetry_detect(&sy, env)){
+        printf("Symmetry: none found, nothing to compare\n");
+        return;
     }
-    return best_a;
+    symmetry_print(&sy);
+    BenchVariant v[2] = { bench_variant(base, "full"), bench_variant(base, "canonical") };
+    for (int i=0; i<2; ++i){
+        v[i].cfg.check_all = 1;
+        v[i].cfg.start_mode = START_UNIFORM;
+    }
+    v[1].sym = &sy;
+    bench_run(env, v, 2, seed, "Symmetry reduction (uniform starts)", "table");
+    double mib = ACTIONS * sizeof(float) / (1024.0*1024.0);
+    printf("Q-table: full %.2f MiB, canonical %.2f MiB\n",
+           (double)env->w * env->h * mib, (double)sy.count * mib);
+    symmetry_free(&sy);
 }
 
-float maxQ(const QModel *m, const Env *env, int s){
-    float best = m->q[idxQ(env,s,0)];
-    for (int a=1; a<ACTIONS; ++a){
-        float v = m->q[idxQ(env,s,a)];
-        if (v>best) best=v;
+// Vanilla Q-learning vs prioritized sweeping, same seed, until optimal.
+void bench_psweep(Env *env, const TrainConfig *base, unsigned seed){
+    BenchVariant v[2] = { bench_variant(base, "q-learning"), bench_variant(base, "") };
+    v[0].cfg.psweep = 0;
+    if (v[1].cfg.psweep <= 0) v[1].cfg.psweep = 10;
+    snprintf(v[1].label, sizeof(v[1].label), "psweep n=%d", v[1].cfg.psweep);
+    bench_run(env, v, 2, seed, "Updates", "method");
+}
+
+// Environment steps vs planning compute to reach the optimal policy for a
+// range of Dyna-Q planning depths, same seed.
+void bench_dyna(Env *env, const TrainConfig *base, unsigned seed){
+    static const int depths[] = { 0, 5, 20, 50 };
+    BenchVariant v[4];
+    for (int i=0; i<4; ++i){
+        v[i] = bench_variant(base, "");
+        snprintf(v[i].label, sizeof(v[i].label), "%d", depths[i]);
+        v[i].cfg.psweep = 0;
+        v[i].cfg.dyna = depths[i];
     }
-    return best;
+    bench_run(env, v, 4, seed, "Dyna-Q", "planning");
 }
 
-int eps_greedy_action(const QModel *m, const Env *env, int s, float eps){
-    // With prob eps choose random action, else greedy
-    if (((float)rand() / (float)RAND_MAX) < eps){
-        return rand() % ACTIONS;
-    } else {
-        return argmax_a(m, env, s);
+// Watkins Q(lambda) against one-step Q-learning: episodes, steps and Q
+// updates until the greedy policy is optimal. upd/step is the mean number
+// of active traces, which pruning keeps far below S*A.
+void bench_lambda(Env *env, const TrainConfig *base, unsigned seed){
+    static const float lambdas[] = { 0.0f, 0.5f, 0.9f, 0.97f };
+    BenchVariant v[4];
+    for (int i=0; i<4; ++i){
+        v[i] = bench_variant(base, "");
+        snprintf(v[i].label, sizeof(v[i].label), "%.2f", lambdas[i]);
+        v[i].cfg.psweep = 0; v[i].cfg.dyna = 0; v[i].cfg.replay = 0;
+        v[i].cfg.lambda = lambdas[i];
     }
+    char title[64];
+    snprintf(title, sizeof(title), "Q(lambda) (trace-min %g)", base->trace_min);
+    bench_run(env, v, 4, seed, title, "lambda");
 }
 
-void save_qtable(const char *path, const QModel *m){
-    FILE *f = fopen(path, "wb");
-    if (!f){ perror("fopen"); exit(1); }
-    fwrite(&m->w, sizeof(int), 1, f);
-    fwrite(&m->h, sizeof(int), 1, f);
-    size_t n = (size_t)(m->w*m->h*ACTIONS);
-    fwrite(m->q, sizeof(float), n, f);
-    fclose(f);
+// Episodes to an optimal greedy policy with and without backward episode
+// replay, on top of whatever update rule the config selects.
+void bench_backward(Env *env, const TrainConfig *base, unsigned seed){
+    BenchVariant v[2] = { bench_variant(base, "off"), bench_variant(base, "backward") };
+    for (int i=0; i<2; ++i) v[i].cfg.backward = i;
+    bench_run(env, v, 2, seed, "Backward episode replay", "replay");
 }
 
-int load_qtable(const char *path, QModel *m){
-    FILE *f = fopen(path, "rb");
-    if (!f) return 0;
-    int w,h;
-    if (fread(&w,sizeof(int),1,f)!=1 || fread(&h,sizeof(int),1,f)!=1){
-        fclose(f); return 0;
+// N-step Q-learning for n = 1, 3, 10: episodes and steps until the greedy
+// policy is optimal, then raw kernel throughput on a stream of random
+// transitions (running sum vs summing the window every step).
+void bench_nstep(Env *env, const TrainConfig *base, unsigned seed){
+    static const int ns[] = { 1, 3, 10 };
+    BenchVariant v[3];
+    for (int i=0; i<3; ++i){
+        v[i] = bench_variant(base, "");
+        snprintf(v[i].label, sizeof(v[i].label), "%d", ns[i]);
+        v[i].cfg.psweep = 0; v[i].cfg.dyna = 0; v[i].cfg.replay = 0; v[i].cfg.lambda = 0.0f;
+        v[i].cfg.nstep = ns[i];
     }
-    qmodel_alloc(m, w, h);
-    size_t n = (size_t)(w*h*ACTIONS);
-    if (fread(m->q, sizeof(float), n, f)!=n){ fclose(f); return 0; }
-    fclose(f);
-    return 1;
-}
+    bench_run(env, v, 3, seed, "N-step Q-learning", "n");
+    const TrainConfig cfg = v[0].cfg;
 
-void render(const Env *env, Pos agent){
-    for (int y=0; y<env->h; ++y){
-        for (int x=0; x<env->w; ++x){
-            char c='.';
-            if (env->walls[y][x]) c='#';
-            if (x==env->goal_x && y==env->goal_y) c='G';
-            if (x==agent.x && y==agent.y) c='A';
-            if (x==env->start_x && y==env->start_y) c = (c=='A')?'A':'S';
-            printf("%c ", c);
+    // Kernel throughput: 1M random steps, replayed until ~1s has passed
+    enum { STREAM = 1 << 20 };
+    int *cells;
+    int nfree = env_free_cells(env, &cells);
+    PackedTransition *stream = (PackedTransition*)malloc(sizeof(PackedTransition) * STREAM);
+    if (!stream){ fprintf(stderr, "OOM\n"); exit(1); }
+    Rng rng = { (uint64_t)seed };
+    for (int i=0; i<STREAM && nfree>0; ++i){
+        int st = cells[rng_int(&rng, nfree)], a = rng_int(&rng, ACTIONS);
+        float r; int done;
+        Pos p = env_step(env, (Pos){ st % env->w, st / env->w }, a, &r, &done);
+        pt_pack(&stream[i], st, a, r, state_id(env, p.x, p.y), 0);
+    }
+    printf("\n%-6s %-12s %14s\n", "n", "sum", "steps/s");
+    for (int i=0; i<3 && nfree>0; ++i){
+        for (int recompute=0; recompute<2; ++recompute){
+            NStepWindow w;
+            nstep_init(&w, ns[i], cfg.gamma);
+            NStepFn fn = recompute ? nstep_step_recompute : nstep_step;
+            QModel q; qmodel_alloc(&q, env->w, env->h);
+            long long steps = 0;
+            double t0 = now_sec(), t;
+            do {
+                for (int k=0; k<STREAM; ++k){
+                    const PackedTransition *p = &stream[k];
+                    fn(&w, &q, env, (int)p->s, (int)(p->ns_ad >> 28) & 3, p->r,
+                       (int)(p->ns_ad & PT_NS_MASK), 0, cfg.alpha);
+                }
+                steps += STREAM;
+                t = now_sec() - t0;
+            } while (t < 1.0);
+            printf("%-6d %-12s %14.3g\n", ns[i], recompute ? "recompute" : "running",
+                   (double)steps / t);
+            qmodel_free(&q);
+            nstep_free(&w);
         }
-        printf("\n");
     }
+    free(stream);
+    free(cells);
 }
 
-void train(Env *env, QModel *m, int episodes, float alpha, float gamma,
-           float eps_start, float eps_min, float eps_decay, int render_every){
-    double avg_len=0.0, avg_ret=0.0;
-    for (int ep=1; ep<=episodes; ++ep){
-        // Exponential epsilon decay
-        float eps = fmaxf(eps_min, eps_start * expf(-eps_decay * (float)ep));
-        Pos s = (Pos){env->start_x, env->start_y};
-        int steps=0; float ret=0.0f;
-        for (;;){
-            if (render_every>0 && (ep%render_every==0)){
-                printf("\n[Episode %d | eps=%.3f]\n", ep, eps);
-                render(env, s);
-            }
-            int s_id = state_id(env, s.x, s.y);
-            int a = eps_greedy_action(m, env, s_id, eps);
-
-            float r; int done;
-            Pos ns = env_step(env, s, a, &r, &done);
-            int ns_id = state_id(env, ns.x, ns.y);
-
-            float td_target = r + (done ? 0.0f : gamma * maxQ(m, env, ns_id));
-            float *Qsa = &m->q[idxQ(env, s_id, a)];
-            *Qsa += alpha * (td_target - *Qsa);
+// Exploring-starts modes against the fixed start: episodes and steps until
+// the greedy policy is optimal from every state (--check-all).
+void bench_starts(Env *env, const TrainConfig *base, unsigned seed){
+    static const char *names[] = { "fixed", "uniform", "reverse", "visits" };
+    BenchVariant v[4];
+    for (int i=0; i<4; ++i){
+        v[i] = bench_variant(base, names[i]);
+        v[i].cfg.check_all = 1;
+        v[i].cfg.start_mode = i;
+    }
+    bench_run(env, v, 4, seed, "Exploring starts", "starts");
+}
 
-            ret += r;
-            s = ns;
-            steps++;
-            if (done || steps >= env->step_limit) break;
-        }
-        avg_len += steps;
-        avg_ret += ret;
-        if (ep % 100 == 0){
-            printf("Episode %5d | avg_len: %6.2f | avg_return: %7.3f\n",
-                   ep, avg_len/100.0, avg_ret/100.0);
-            avg_len = 0.0; avg_ret = 0.0;
-        }
+// Replay minibatch throughput with and without state-sorted batches. The
+// buffer is filled with one random move from each of `cap` random free cells,
+// so batches touch Q rows spread over the whole table, as on a map whose
+// Q-table does not fit in cache.
+void bench_replay(const Env *env, int cap, int batch, float alpha, float gamma, unsigned seed){
+    if (cap <= 0) cap = 1 << 20;
+    if (batch <= 0) batch = 256;
+    int *cells;
+    int nfree = env_free_cells(env, &cells);
+    if (nfree == 0){ free(cells); return; }
+    ReplayBuffer rb;
+    replay_init(&rb, cap, batch, 0);
+    Rng rng = { (uint64_t)seed };
+    for (int i=0; i<cap; ++i){
+        int s = cells[rng_int(&rng, nfree)], a = rng_int(&rng, ACTIONS);
+        float r; int done;
+        Pos p = env_step(env, (Pos){ s % env->w, s / env->w }, a, &r, &done);
+        replay_push(&rb, s, a, r, state_id(env, p.x, p.y), done);
     }
+    free(cells);
+    double qmb = (double)env->w * env->h * ACTIONS * sizeof(float) / (1024.0*1024.0);
+    printf("Replay minibatch updates, %dx%d (Q %.0f MiB), buffer %d, batch %d\n",
+           env->w, env->h, qmb, cap, batch);
+    for (int sorted=0; sorted<2; ++sorted){
+        QModel q; qmodel_alloc(&q, env->w, env->h);
+        rb.sorted = sorted;
+        Rng r2 = { (uint64_t)seed + 1 };
+        long long updates = 0;
+        double t0 = now_sec(), dt;
+        do {
+            for (int k=0; k<64; ++k) updates += replay_update(&rb, &q, env, alpha, gamma, &r2);
+            dt = now_sec() - t0;
+        } while (dt < 2.0);
+        printf("  %-8s %12.3g updates/s\n", sorted ? "sorted" : "unsorted", (double)updates / dt);
+        qmodel_free(&q);
+    }
+    replay_free(&rb);
 }
 
 void play_greedy(const Env *env, const QModel *m, int episodes, int render_flag){
     for (int ep=1; ep<=episodes; ++ep){
         Pos s = (Pos){env->start_x, env->start_y};
         float ret=0; int steps=0;
+        // Brent's cycle detection: the greedy walk is deterministic, so
+        // meeting the saved state again means we are in a loop of length lam.
+        int tortoise = state_id(env, s.x, s.y), power = 1, lam = 0, loop = 0;
         printf("\n[Play %d]\n", ep);
         for (;;){
             if (render_flag){
@@ -209,9 +3791,210 @@ void play_greedy(const Env *env, const QModel *m, int episodes, int render_flag)
             ret += r; steps++;
             s = ns;
             if (done || steps>=env->step_limit) break;
+            sid = state_id(env, s.x, s.y);
+            lam++;
+            if (sid == tortoise){ loop = lam; break; }
+            if (lam == power){ tortoise = sid; power <<= 1; lam = 0; }
+        }
+        if (loop)
+            printf("Return: %.2f | Steps: %d | Loop detected (cycle length %d)\n", ret, steps, loop);
+        else
+            printf("Return: %.2f | Steps: %d\n", ret, steps);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Batch evaluation of the greedy policy from many start cells
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int starts;
+    int reached, loops, timeouts;
+    double mean_len, mean_return;
+    int p50, p90, p99, max_len;   // over starts that reach the goal
+    double seconds;
+} EvalSummary;
+
+#define EVAL_UNREACHED (-1)
+#define EVAL_LOOP      (-2)
+
+typedef struct {
+    const Env *env;
+    const QModel *m;
+    const int *starts;
+    int n;
+    int *len;              // per start: steps to goal, EVAL_LOOP or EVAL_UNREACHED
+    atomic_int next;
+} EvalShared;
+
+#define EVAL_CHUNK 256
+#define EVAL_PATH_CAP 4096   // rollout states remembered for clearing seen[]
+
+static void *eval_worker(void *arg){
+    EvalShared *sh = (EvalShared*)arg;
+    const Env *env = sh->env;
+    int S = env->w * env->h;
+    // Deterministic env + greedy policy: revisiting a state means a loop.
+    // seen[] is a bitset of the current rollout's states (S/8 bytes per
+    // thread), cleared along the path afterwards: from path[] when the
+    // rollout fits, else by walking it again.
+    uint64_t *seen = (uint64_t*)calloc(((size_t)S + 63) / 64, sizeof(uint64_t));
+    int *path = (int*)malloc(sizeof(int) * EVAL_PATH_CAP);
+    if (!seen || !path){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (;;){
+        int lo = atomic_fetch_add(&sh->next, EVAL_CHUNK);
+        if (lo >= sh->n) break;
+        int hi = lo + EVAL_CHUNK < sh->n ? lo + EVAL_CHUNK : sh->n;
+        for (int i=lo; i<hi; ++i){
+            int sid = sh->starts[i];
+            Pos s = (Pos){ sid % env->w, sid / env->w };
+            int steps = 0, result = EVAL_UNREACHED;
+            for (;;){
+                seen[sid >> 6] |= 1ull << (sid & 63);
+                if (steps < EVAL_PATH_CAP) path[steps] = sid;
+                float r; int done;
+                s = env_step(env, s, argmax_a(sh->m, env, sid), &r, &done);
+                steps++;
+                if (done){ result = steps; break; }
+                if (steps >= env->step_limit) break;
+                sid = state_id(env, s.x, s.y);
+                if (seen[sid >> 6] >> (sid & 63) & 1){ result = EVAL_LOOP; break; }
+            }
+            sh->len[i] = result;
+            if (steps <= EVAL_PATH_CAP){
+                for (int k=0; k<steps; ++k) seen[path[k] >> 6] = 0;
+            } else {
+                sid = sh->starts[i];
+                s = (Pos){ sid % env->w, sid / env->w };
+                for (int k=0; k<steps; ++k){
+                    seen[sid >> 6] = 0;
+                    float r; int done;
+                    s = env_step(env, s, argmax_a(sh->m, env, sid), &r, &done);
+                    sid = state_id(env, s.x, s.y);
+                }
+            }
+        }
+    }
+    free(path);
+    free(seen);
+    return NULL;
+}
+
+static int cmp_int(const void *a, const void *b){
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x>y) - (x<y);
+}
+
+// Reduce per-start outcomes into a summary. Starts that never reach the goal
+// are charged the return play_greedy would report: step_limit step rewards.
+void eval_summarize(const Env *env, int *len, int n, EvalSummary *out){
+    memset(out, 0, sizeof(*out));
+    out->starts = n;
+    int k = 0;
+    double sum_len = 0.0, sum_ret = 0.0;
+    for (int i=0; i<n; ++i){
+        if (len[i] >= 0){
+            len[k++] = len[i];
+            sum_len += len[i];
+            sum_ret += (double)(len[i]-1) * env->step_reward + env->goal_reward;
+        } else {
+            if (len[i]==EVAL_LOOP) out->loops++; else out->timeouts++;
+            sum_ret += (double)env->step_limit * env->step_reward;
+        }
+    }
+    out->reached = k;
+    out->mean_return = n ? sum_ret / n : 0.0;
+    if (k){
+        qsort(len, (size_t)k, sizeof(int), cmp_int);
+        out->mean_len = sum_len / k;
+        out->p50 = len[(size_t)(k-1) * 50 / 100];
+        out->p90 = len[(size_t)(k-1) * 90 / 100];
+        out->p99 = len[(size_t)(k-1) * 99 / 100];
+        out->max_len = len[k-1];
+    }
+}
+
+void eval_batch(const Env *env, const QModel *m, const int *starts, int n,
+                int threads, EvalSummary *out){
+    EvalShared sh;
+    sh.env = env; sh.m = m; sh.starts = starts; sh.n = n;
+    sh.len = (int*)malloc(sizeof(int) * (size_t)(n>0 ? n : 1));
+    if (!sh.len){ fprintf(stderr, "OOM\n"); exit(1); }
+    atomic_init(&sh.next, 0);
+    double t0 = now_sec();
+    if (threads <= 1){
+        eval_worker(&sh);
+    } else {
+        pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)threads);
+        if (!tids){ fprintf(stderr, "OOM\n"); exit(1); }
+        for (int i=0; i<threads; ++i){
+            if (pthread_create(&tids[i], NULL, eval_worker, &sh) != 0){
+                fprintf(stderr, "pthread_create failed\n"); exit(1);
+            }
+        }
+        for (int i=0; i<threads; ++i) pthread_join(tids[i], NULL);
+        free(tids);
+    }
+    eval_summarize(env, sh.len, n, out);
+    out->seconds = now_sec() - t0;
+    free(sh.len);
+}
+
+// Greedy policy as a functional graph: each state has one successor. Every
+// state is resolved once; a walk stops at the first resolved state (memoized)
+// and its outcome is written back along the whole path (path compression).
+// A walk that meets its own path has found a cycle, and every state on it
+// leads into that loop. out[s] = steps to goal, EVAL_LOOP, or EVAL_UNREACHED
+// for walls and the goal itself. O(S) time, one extra S-sized stack.
+void policy_graph_eval(const Env *env, const QModel *m, int *out){
+    const int UNSEEN = INT_MIN, ON_PATH = INT_MIN + 1;
+    int S = env->w * env->h;
+    int goal = state_id(env, env->goal_x, env->goal_y);
+    int *path = (int*)malloc(sizeof(int) * (size_t)S);
+    if (!path){ fprintf(stderr, "OOM\n"); exit(1); }
+    for (int s=0; s<S; ++s) out[s] = (env->walls[s] || s==goal) ? EVAL_UNREACHED : UNSEEN;
+    for (int s0=0; s0<S; ++s0){
+        if (out[s0] != UNSEEN) continue;
+        int n = 0, s = s0, tail;
+        for (;;){
+            out[s] = ON_PATH;
+            path[n++] = s;
+            float r; int done;
+            Pos p = env_step(env, (Pos){ s % env->w, s / env->w },
+                             argmax_a(m, env, s), &r, &done);
+            if (done){ tail = 0; break; }
+            s = state_id(env, p.x, p.y);
+            if (out[s] == ON_PATH){ tail = EVAL_LOOP; break; }
+            if (out[s] != UNSEEN){ tail = out[s]; break; }
+        }
+        while (n > 0){
+            int v = path[--n];
+            out[v] = tail==EVAL_LOOP ? EVAL_LOOP : ++tail;
         }
-        printf("Return: %.2f | Steps: %d\n", ret, steps);
     }
+    free(path);
+}
+
+void eval_graph(const Env *env, const QModel *m, const int *starts, int n, EvalSummary *out){
+    int S = env->w * env->h;
+    double t0 = now_sec();
+    int *res = (int*)malloc(sizeof(int) * (size_t)S);
+    int *len = (int*)malloc(sizeof(int) * (size_t)(n>0 ? n : 1));
+    if (!res || !len){ fprintf(stderr, "OOM\n"); exit(1); }
+    policy_graph_eval(env, m, res);
+    for (int i=0; i<n; ++i) len[i] = res[starts[i]];
+    eval_summarize(env, len, n, out);
+    out->seconds = now_sec() - t0;
+    free(len); free(res);
+}
+
+void print_eval(const char *label, const EvalSummary *e){
+    printf("%s: %d starts | success %.2f%% (%d) | loops %d | timeouts %d\n",
+           label, e->starts, e->starts ? 100.0 * e->reached / e->starts : 0.0,
+           e->reached, e->loops, e->timeouts);
+    printf("  path length mean %.2f | p50 %d | p90 %d | p99 %d | max %d\n",
+           e->mean_len, e->p50, e->p90, e->p99, e->max_len);
+    printf("  mean return %.3f | %.3fs\n", e->mean_return, e->seconds);
 }
 
 int main(int argc, char **argv){
@@ -220,6 +4003,63 @@ int main(int argc, char **argv){
     int play_eps = 0;
     int render_flag = 0;
     int render_every = 0; // render during training every N episodes (0=off)
+    int threads = 1;
+    int sharded = 0;
+    int bench_shard = 0;
+    int eval_all = 0;
+    int eval_sample = 0;
+    int eval_by_graph = 0;
+    int vi_method = -1;   // -1 = off, else VI_JACOBI / VI_GAUSS_SEIDEL
+    float vi_tol = 1e-3f;
+    int vi_sweeps = 1000000;
+    int bench_vi_flag = 0;
+    int mg_levels = 0;
+    int check_every = 0;
+    int check_all = 0;
+    int bfs_bitwave = 0;
+    int shape = 0;
+    int bench_bfs_flag = 0;
+    int qinit = QINIT_ZERO;
+    float qinit_value = 10.0f;
+    int qinit_levels = 2;
+    int bench_init_flag = 0;
+    int psweep = 0;
+    float psweep_theta = 1e-3f;
+    int bench_psweep_flag = 0;
+    int dyna = 0;
+    int bench_dyna_flag = 0;
+    int replay = 0;
+    int replay_batch = 32;
+    int replay_sort = 0;
+    int bench_replay_flag = 0;
+    float lambda = 0.0f;
+    float trace_min = 1e-3f;
+    int bench_lambda_flag = 0;
+    int backward = 0;
+    int bench_backward_flag = 0;
+    int nstep = 1;
+    int bench_nstep_flag = 0;
+    double train_seconds = 0.0;
+    long long train_steps = 0;
+    int until_optimal = 0;
+    int start_mode = START_FIXED;
+    int start_ramp = 1000;
+    int bench_starts_flag = 0;
+    int curriculum = 0;
+    int upsample = UPSAMPLE_BILINEAR;
+    int bench_curriculum_flag = 0;
+    int load_resample = 0;
+    int load_mmap = 0;
+    int load_verify = 0;
+    int checkpoint_every = 0;
+    double checkpoint_seconds = 0.0;
+    int contract = 0;
+    int bench_contract_flag = 0;
+    int use_options = 0;
+    int bench_options_flag = 0;
+    int use_symmetry = 0;
+    int bench_symmetry_flag = 0;
+    const char *map_path = NULL;
     unsigned seed = (unsigned)time(NULL);
     const char *save_path = NULL;
     const char *load_path = NULL;
@@ -232,6 +4072,45 @@ int main(int argc, char **argv){
     // Arg parsing (minimal)
     for (int i=1; i<argc; ++i){
         if (!strcmp(argv[i],"--train") && i+1<argc) train_eps = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--train-seconds") && i+1<argc) train_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i],"--train-steps") && i+1<argc) train_steps = atoll(argv[++i]);
+        else if (!strcmp(argv[i],"--until-optimal")) until_optimal = 1;
+        else if (!strcmp(argv[i],"--starts") && i+1<argc){
+            const char *mode = argv[++i];
+            if (!strcmp(mode,"fixed")) start_mode = START_FIXED;
+            else if (!strcmp(mode,"uniform")) start_mode = START_UNIFORM;
+            else if (!strncmp(mode,"reverse",7) && (mode[7]=='\0' || mode[7]==':')){
+                start_mode = START_REVERSE;
+                if (mode[7]==':') start_ramp = atoi(mode+8);
+            }
+            else if (!strcmp(mode,"visits")) start_mode = START_VISITS;
+            else { fprintf(stderr, "Unknown --starts %s (fixed|uniform|reverse[:N]|visits)\n", mode); return 1; }
+        }
+        else if (!strcmp(argv[i],"--bench-starts")) bench_starts_flag = 1;
+        else if (!strcmp(argv[i],"--curriculum") && i+1<argc) curriculum = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--upsample") && i+1<argc){
+            const char *mode = argv[++i];
+            if (!strcmp(mode,"nearest")) upsample = UPSAMPLE_NEAREST;
+            else if (!strcmp(mode,"bilinear")) upsample = UPSAMPLE_BILINEAR;
+            else { fprintf(stderr, "Unknown --upsample %s (nearest|bilinear)\n", mode); return 1; }
+        }
+        else if (!strcmp(argv[i],"--bench-curriculum")) bench_curriculum_flag = 1;
+        else if (!strcmp(argv[i],"--resample")) load_resample = 1;
+        else if (!strcmp(argv[i],"--mmap")) load_mmap = 1;
+        else if (!strcmp(argv[i],"--verify")) load_verify = 1;
+        else if (!strcmp(argv[i],"--checkpoint-every") && i+1<argc){
+            // N episodes, or Ts seconds
+            char *end;
+            double v = strtod(argv[++i], &end);
+            if (*end == 's' && end[1] == 0) checkpoint_seconds = v > 0.0 ? v : -1.0;
+            else checkpoint_every = *end == 0 && v >= 1.0 && v <= INT_MAX ? (int)v : -1;
+        }
+        else if (!strcmp(argv[i],"--contract")) contract = 1;
+        else if (!strcmp(argv[i],"--bench-contract")) bench_contract_flag = 1;
+        else if (!strcmp(argv[i],"--options")) use_options = 1;
+        else if (!strcmp(argv[i],"--bench-options")) bench_options_flag = 1;
+        else if (!strcmp(argv[i],"--symmetry")) use_symmetry = 1;
+        else if (!strcmp(argv[i],"--bench-symmetry")) bench_symmetry_flag = 1;
         else if (!strcmp(argv[i],"--play") && i+1<argc) play_eps = atoi(argv[++i]);
         else if (!strcmp(argv[i],"--render")) render_flag = 1;
         else if (!strcmp(argv[i],"--render-every") && i+1<argc) render_every = atoi(argv[++i]);
@@ -244,21 +4123,135 @@ int main(int argc, char **argv){
         else if (!strcmp(argv[i],"--eps-start") && i+1<argc) eps_start = strtof(argv[++i], NULL);
         else if (!strcmp(argv[i],"--eps-min") && i+1<argc) eps_min = strtof(argv[++i], NULL);
         else if (!strcmp(argv[i],"--eps-decay") && i+1<argc) eps_decay = strtof(argv[++i], NULL);
+        else if (!strcmp(argv[i],"--threads") && i+1<argc) threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--sharded")) sharded = 1;
+        else if (!strcmp(argv[i],"--bench-sharded")) bench_shard = 1;
+        else if (!strcmp(argv[i],"--map") && i+1<argc) map_path = argv[++i];
+        else if (!strcmp(argv[i],"--eval")) eval_all = 1;
+        else if (!strcmp(argv[i],"--eval-sample") && i+1<argc) eval_sample = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--eval-graph")) eval_by_graph = 1;
+        else if (!strcmp(argv[i],"--vi") && i+1<argc){
+            ++i;
+            if (!strcmp(argv[i],"jacobi")) vi_method = VI_JACOBI;
+            else if (!strcmp(argv[i],"gs")) vi_method = VI_GAUSS_SEIDEL;
+            else if (!strcmp(argv[i],"rb")) vi_method = VI_RED_BLACK;
+            else { fprintf(stderr, "Unknown --vi method %s (jacobi|gs|rb)\n", argv[i]); return 1; }
+        }
+        else if (!strcmp(argv[i],"--vi-tol") && i+1<argc) vi_tol = strtof(argv[++i], NULL);
+        else if (!strcmp(argv[i],"--vi-sweeps") && i+1<argc) vi_sweeps = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--bench-vi")) bench_vi_flag = 1;
+        else if (!strcmp(argv[i],"--multigrid") && i+1<argc) mg_levels = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--check-every") && i+1<argc) check_every = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--check-all")) check_all = 1;
+        else if (!strcmp(argv[i],"--bfs") && i+1<argc){
+            ++i;
+            if (!strcmp(argv[i],"queue")) bfs_bitwave = 0;
+            else if (!strcmp(argv[i],"bitwave")) bfs_bitwave = 1;
+            else { fprintf(stderr, "Unknown --bfs method %s (queue|bitwave)\n", argv[i]); return 1; }
+        }
+        else if (!strcmp(argv[i],"--shape")) shape = 1;
+        else if (!strcmp(argv[i],"--bench-bfs")) bench_bfs_flag = 1;
+        else if (!strcmp(argv[i],"--q-init") && i+1<argc){
+            const char *mode = argv[++i];
+            const char *arg = strchr(mode, ':');
+            size_t len = arg ? (size_t)(arg - mode) : strlen(mode);
+            if (len==4 && !strncmp(mode, "zero", len)) qinit = QINIT_ZERO;
+            else if (len==5 && !strncmp(mode, "const", len)){
+                qinit = QINIT_CONST;
+                if (arg) qinit_value = strtof(arg+1, NULL);
+            }
+            else if (len==9 && !strncmp(mode, "manhattan", len)) qinit = QINIT_MANHATTAN;
+            else if (len==6 && !strncmp(mode, "coarse", len)){
+                qinit = QINIT_COARSE;
+                if (arg) qinit_levels = atoi(arg+1);
+            }
+            else { fprintf(stderr, "Unknown --q-init %s (zero|const[:V]|manhattan|coarse[:L])\n", mode); return 1; }
+        }
+        else if (!strcmp(argv[i],"--bench-init")) bench_init_flag = 1;
+        else if (!strcmp(argv[i],"--psweep") && i+1<argc) psweep = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--psweep-theta") && i+1<argc) psweep_theta = strtof(argv[++i], NULL);
+        else if (!strcmp(argv[i],"--bench-psweep")) bench_psweep_flag = 1;
+        else if (!strcmp(argv[i],"--dyna") && i+1<argc) dyna = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--bench-dyna")) bench_dyna_flag = 1;
+        else if (!strcmp(argv[i],"--replay") && i+1<argc) replay = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--batch") && i+1<argc) replay_batch = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--replay-sort")) replay_sort = 1;
+        else if (!strcmp(argv[i],"--bench-replay")) bench_replay_flag = 1;
+        else if (!strcmp(argv[i],"--lambda") && i+1<argc) lambda = strtof(argv[++i], NULL);
+        else if (!strcmp(argv[i],"--trace-min") && i+1<argc) trace_min = strtof(argv[++i], NULL);
+        else if (!strcmp(argv[i],"--bench-lambda")) bench_lambda_flag = 1;
+        else if (!strcmp(argv[i],"--backward")) backward = 1;
+        else if (!strcmp(argv[i],"--bench-backward")) bench_backward_flag = 1;
+        else if (!strcmp(argv[i],"--nstep") && i+1<argc) nstep = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--bench-nstep")) bench_nstep_flag = 1;
         else if (!strcmp(argv[i],"--help")){
             printf("Q-learning Grid World\n"
                    "  --train N          Train for N episodes\n"
-                   "  --play N           Play greedy policy for N episodes\n"
+                   "  --train-seconds T  Train for T seconds of wall time\n"
+                   "  --train-steps N    Train for N environment steps\n"
+                   "  --until-optimal    Train until the greedy policy is optimal\n"
+                   "  --starts M         Episode starts: fixed|uniform|reverse[:N]|visits (default fixed)\n"
+                   "  --bench-starts     Episodes to an all-states optimal policy for each --starts mode\n"
+                   "  --curriculum L     Train on the map coarsened L times first, then finer levels\n"
+                   "  --upsample M       Curriculum/--resample Q upsampling: nearest|bilinear (default bilinear)\n"
+                   "  --bench-curriculum Compute to optimal: direct vs curriculum training\n"
+                   "  --resample         With --load, upsample a smaller table to the env size\n"
+                   "  --contract         Train/solve on the junction graph (corridors contracted)\n"
+                   "  --bench-contract   Per-cell vs contracted training and value iteration\n"
+                   "  --options          SMDP Q-learning over run-to-junction and room-to-doorway options\n"
+                   "  --bench-options    Decisions to optimal: primitive vs options\n"
+                   "  --symmetry         Store Q for canonical states of a mirrored/rotated map\n"
+                   "  --bench-symmetry   All-states convergence: full vs symmetry-reduced Q-table\n");
+            printf("  --play N           Play greedy policy for N episodes\n"
                    "  --render           Render grid during play\n"
                    "  --render-every N   Render training every N episodes\n"
                    "  --save PATH        Save Q-table to PATH\n"
                    "  --load PATH        Load Q-table from PATH\n"
-                   "  --size W H         Grid size (<= %d x %d)\n"
-                   "  --alpha A          Learning rate (default 0.1)\n"
+                   "  --mmap             With --load, map the table file instead of reading it\n"
+                   "  --verify           With --mmap, check the payload CRC (reads the whole file)\n"
+                   "  --checkpoint-every N|Ts Write --save PATH every N episodes or T seconds while training\n"
+                   "  --size W H         Grid size (<= %d x %d)\n", MAX_W, MAX_H);
+            printf("  --alpha A          Learning rate (default 0.1)\n"
                    "  --gamma G          Discount (default 0.99)\n"
                    "  --eps-start E      Epsilon start (default 1.0)\n"
                    "  --eps-min E        Epsilon min (default 0.05)\n"
                    "  --eps-decay D      Epsilon decay (default 0.0025)\n"
-                   "  --seed S           RNG seed\n", MAX_W, MAX_H);
+                   "  --seed S           RNG seed\n"
+                   "  --threads N        Parallel training threads (default 1)\n"
+                   "  --sharded          Parallel: owner-computes state shards\n"
+                   "  --bench-sharded    Compare shared vs sharded training\n"
+                   "  --map PATH         Load grid from text map (# . S G)\n"
+                   "  --eval             Evaluate greedy policy from every free cell\n"
+                   "  --eval-sample N    Evaluate greedy policy from N random free cells\n"
+                   "  --eval-graph       Evaluate via O(S) policy graph instead of rollouts\n"
+                   "  --vi M             Solve by value iteration, M = jacobi|gs|rb\n"
+                   "  --vi-tol T         VI stops when |V - V*| <= T (default 1e-3)\n"
+                   "  --vi-sweeps N      VI sweep limit (default 1000000)\n"
+                   "  --bench-vi         Compare VI methods and red-black thread scaling\n"
+                   "  --multigrid L      VI coarse-to-fine over up to L 2x2-coarsened levels\n"
+                   "  --check-every K    Stop training once greedy policy is optimal (checked every K eps)\n"
+                   "  --check-all        Optimality check covers all states, not just the start\n"
+                   "  --bfs M            Distance field method: queue|bitwave (default queue; bitwave is slower)\n"
+                   "  --shape            Potential-based reward shaping from goal distances\n"
+                   "  --bench-bfs        Time queue vs bit-parallel BFS\n"
+                   "  --q-init M         Initial Q: zero|const[:V]|manhattan|coarse[:L] (default zero)\n"
+                   "  --bench-init       Steps to optimal policy for each --q-init mode\n"
+                   "  --psweep N         Prioritized sweeping with N planning updates per step\n"
+                   "  --psweep-theta T   Prioritized sweeping queue threshold (default 1e-3)\n"
+                   "  --bench-psweep     Updates/time to optimal: Q-learning vs prioritized sweeping\n"
+                   "  --dyna N           Dyna-Q with N planning updates per real step\n"
+                   "  --bench-dyna       Env steps to optimal for Dyna-Q planning depths 0/5/20/50\n"
+                   "  --replay CAP       Train from a replay buffer of CAP transitions\n"
+                   "  --batch B          Replay minibatch size (default 32)\n"
+                   "  --replay-sort      Sort each minibatch by state id before applying it\n"
+                   "  --bench-replay     Replay updates/s with and without sorted minibatches\n"
+                   "  --lambda L         Watkins Q(lambda) eligibility traces (default 0 = off)\n"
+                   "  --trace-min T      Prune traces below T (default 1e-3)\n"
+                   "  --bench-lambda     Steps/updates to optimal for lambda 0/0.5/0.9/0.97\n"
+                   "  --backward         Replay each episode backwards when it ends\n"
+                   "  --bench-backward   Episodes to optimal with and without --backward\n"
+                   "  --nstep N          N-step Q-learning (default 1)\n"
+                   "  --bench-nstep      Convergence and kernel steps/s for n = 1, 3, 10\n");
             return 0;
         }
     }
@@ -267,41 +4260,374 @@ int main(int argc, char **argv){
         fprintf(stderr, "Invalid --size. Use 2..%dx2..%d\n", MAX_W, MAX_H);
         return 1;
     }
+    // train() runs one update rule per step: replay, psweep, or the online
+    // update (optionally with traces and Dyna planning)
+    if (replay<0 || replay_batch<1 || (replay>0 && (threads>1 || psweep>0 || dyna>0 || lambda>0.0f))){
+        fprintf(stderr, "Invalid --replay/--batch (single-threaded; not with --psweep/--dyna/--lambda)\n");
+        return 1;
+    }
+    if (lambda<0.0f || lambda>1.0f || !(trace_min>0.0f) || (lambda>0.0f && threads>1)){
+        fprintf(stderr, "Invalid --lambda/--trace-min. Use 0 <= L <= 1, T > 0 "
+                        "(single-threaded training only)\n");
+        return 1;
+    }
+    if (until_optimal && check_every<=0) check_every = 10;
+    int training = train_eps>0 || train_seconds>0.0 || train_steps>0 || until_optimal;
+    if (train_seconds<0.0 || train_steps<0
+        || (threads>1 && (train_seconds>0.0 || train_steps>0 || until_optimal))){
+        fprintf(stderr, "Invalid --train-seconds/--train-steps/--until-optimal "
+                        "(single-threaded training only)\n");
+        return 1;
+    }
+    if (check_every<0 || (check_every>0 && threads>1)){
+        fprintf(stderr, "Invalid --check-every (K >= 0, single-threaded training only)\n");
+        return 1;
+    }
+    if (shape && threads>1){
+        fprintf(stderr, "Invalid --shape (single-threaded training only)\n");
+        return 1;
+    }
+    if (psweep<0 || (psweep>0 && (threads>1 || dyna>0 || lambda>0.0f))){
+        fprintf(stderr, "Invalid --psweep (N >= 0, single-threaded; not with --dyna/--lambda)\n");
+        return 1;
+    }
+    if (dyna<0 || (dyna>0 && threads>1)){
+        fprintf(stderr, "Invalid --dyna (N >= 0, single-threaded training only)\n");
+        return 1;
+    }
+    if (backward && threads>1){
+        fprintf(stderr, "Invalid --backward (single-threaded training only)\n");
+        return 1;
+    }
+    if (qinit != QINIT_ZERO && load_path){
+        fprintf(stderr, "Invalid --q-init (fresh tables only; not with --load)\n");
+        return 1;
+    }
+    if (load_verify && !load_mmap){
+        fprintf(stderr, "Invalid --verify (with --load PATH --mmap; a read load always checks the CRC)\n");
+        return 1;
+    }
+    if (checkpoint_every < 0 || checkpoint_seconds < 0.0
+        || ((checkpoint_every > 0 || checkpoint_seconds > 0.0)
+            && (!save_path || threads>1 || curriculum>0 || contract || use_options))){
+        fprintf(stderr, "Invalid --checkpoint-every. Use N episodes or Ts seconds, with --save PATH "
+                        "(single-threaded; not with --curriculum/--contract/--options)\n");
+        return 1;
+    }
+    if (use_symmetry && (threads>1 || curriculum>0 || contract || use_options || load_path)){
+        fprintf(stderr, "Invalid --symmetry (single-threaded; not with --curriculum/--contract/"
+                        "--options/--load)\n");
+        return 1;
+    }
+    if (use_options && (threads>1 || curriculum>0 || contract)){
+        fprintf(stderr, "Invalid --options (single-threaded; not with --curriculum/--contract)\n");
+        return 1;
+    }
+    if (contract && (threads>1 || curriculum>0 || mg_levels>0)){
+        fprintf(stderr, "Invalid --contract (single-threaded; not with --curriculum/--multigrid)\n");
+        return 1;
+    }
+    if (curriculum<0 || (curriculum>0 && threads>1)){
+        fprintf(stderr, "Invalid --curriculum (L >= 0, single-threaded training only)\n");
+        return 1;
+    }
+    if (start_ramp<1 || (threads>1 && start_mode==START_VISITS)){
+        fprintf(stderr, "Invalid --starts (reverse:N needs N >= 1; visits is single-threaded)\n");
+        return 1;
+    }
+    if (nstep<1 || (nstep>1 && (threads>1 || lambda>0.0f || dyna>0 || psweep>0 || replay>0))){
+        fprintf(stderr, "Invalid --nstep. Use N >= 1 (single-threaded; not with "
+                        "--lambda/--dyna/--psweep/--replay)\n");
+        return 1;
+    }
+    if (threads<1 || threads>MAX_THREADS){
+        fprintf(stderr, "Invalid --threads. Use 1..%d\n", MAX_THREADS);
+        return 1;
+    }
+    if ((sharded || bench_shard) && threads>MAX_SHARDED_THREADS){
+        fprintf(stderr, "Invalid --threads for --sharded. Use 1..%d\n", MAX_SHARDED_THREADS);
+        return 1;
+    }
     srand(seed);
 
-    Env env; env_init(&env, W, H);
+    Env env;
+    if (map_path){
+        if (!env_load_map(&env, map_path)){
+            fprintf(stderr, "Failed to load map from %s\n", map_path);
+            return 1;
+        }
+        W = env.w; H = env.h;
+        printf("Loaded map %dx%d from %s\n", W, H, map_path);
+    } else {
+        env_init(&env, W, H);
+    }
+    Symmetry sym = { 0 };
+    if (use_symmetry){
+        if (symmetry_detect(&sym, &env)){
+            symmetry_print(&sym);
+            env.sym = &sym;
+        } else {
+            printf("Symmetry: none found, storing every state\n");
+        }
+    }
     QModel q;
+    QtMeta loaded = { 0 };
     if (load_path){
-        if (!load_qtable(load_path, &q)){
+        double t_load = now_sec();
+        if (!load_qtable(load_path, &q, !load_mmap ? 0 : load_verify ? QT_MMAP_VERIFY : QT_MMAP,
+                         &loaded)){
             fprintf(stderr, "Failed to load Q-table from %s\n", load_path);
             return 1;
         }
+        t_load = now_sec() - t_load;
+        if (q.map && !load_verify)
+            fprintf(stderr, "Warning: %s: payload CRC not checked (--mmap without --verify)\n",
+                    load_path);
+        if ((q.w!=W || q.h!=H) && load_resample && q.w<=W && q.h<=H){
+            QModel big;
+            qmodel_alloc(&big, W, H);
+            qmodel_resample(&q, &big, upsample);
+            qmodel_rescale_distance(&big, &env, gamma,
+                                    fmaxf((float)W / (float)q.w, (float)H / (float)q.h));
+            printf("Resampled Q-table %dx%d from %s to %dx%d\n", q.w, q.h, load_path, W, H);
+            qmodel_free(&q);
+            q = big;
+            free(loaded.state);   // belongs to the smaller map
+            loaded.state = NULL;
+        }
         if (q.w!=W || q.h!=H){
-            fprintf(stderr, "Loaded table size %dx%d doesn't match env %dx%d\n",
-                    q.w, q.h, W, H);
+            fprintf(stderr, "Loaded table size %dx%d doesn't match env %dx%d%s\n",
+                    q.w, q.h, W, H, load_resample ? "" : " (--resample upsamples a smaller one)");
             qmodel_free(&q);
             return 1;
         }
-        printf("Loaded Q-table %dx%d from %s\n", q.w, q.h, load_path);
+        if (!load_resample){
+            printf("Loaded Q-table %dx%d from %s (%s, %.1f ms)", q.w, q.h, load_path,
+                   !q.map ? "read" : load_verify ? "mmap, verified" : "mmap, payload unverified",
+                   t_load * 1e3);
+            if (loaded.episodes > 0)
+                printf(" | trained %lld episodes, alpha %g, gamma %g", loaded.episodes,
+                       loaded.alpha, loaded.gamma);
+            if (loaded.state) printf(" | training state %.1f KiB", loaded.state_bytes / 1024.0);
+            printf("\n");
+        }
     } else {
-        qmodel_alloc(&q, W, H);
+        qmodel_alloc_env(&q, &env);
+        qmodel_init(&q, &env, qinit, qinit_value, qinit_levels, gamma);
+    }
+
+    if (mg_levels > 0 && vi_method < 0) vi_method = VI_GAUSS_SEIDEL;
+    if (vi_method >= 0 && contract){
+        JunctionGraph g;
+        jgraph_build(&g, &env, gamma);
+        float *Qg = (float*)calloc((size_t)g.n * ACTIONS, sizeof(float));
+        if (!Qg){ fprintf(stderr, "OOM\n"); return 1; }
+        ViStats vs = jgraph_value_iteration(&g, Qg, gamma, vi_tol, vi_sweeps);
+        printf("Value iteration (junction graph, %d nodes): %d sweeps | delta %.3g | %.3fs\n",
+               g.n, vs.sweeps, vs.delta, vs.seconds);
+        jgraph_expand(&g, Qg, &env, gamma, &q);
+        free(Qg);
+        jgraph_free(&g);
+    } else if (vi_method >= 0){
+        DetMdp mdp;
+        mdp_from_env(&mdp, &env, gamma);
+        float *V = (float*)calloc((size_t)mdp.S + 1, sizeof(float));
+        if (!V){ fprintf(stderr, "OOM\n"); return 1; }
+        static const char *vi_names[] = { "jacobi", "gauss-seidel", "red-black" };
+        ViStats vs;
+        if (mg_levels > 0){
+            printf("Multigrid value iteration (%s), up to %d coarse levels\n",
+                   vi_names[vi_method], mg_levels);
+            vs = value_iteration_multigrid(&env, gamma, V, mg_levels, vi_method,
+                                           vi_tol, vi_sweeps, threads);
+        } else {
+            vs = vi_solve(&mdp, V, &env, vi_method, vi_tol, vi_sweeps, threads);
+        }
+        printf("Value iteration (%s): %d sweeps | delta %.3g | %.3fs\n",
+               vi_names[vi_method], vs.sweeps, vs.delta, vs.seconds);
+        qmodel_from_values(&q, &env, &mdp, V);
+        free(V);
+        mdp_free(&mdp);
+    }
+
+    if (bench_vi_flag){
+        bench_vi(&env, gamma, vi_tol, vi_sweeps, threads);
     }
 
-    if (train_eps>0){
-        train(&env, &q, train_eps, alpha, gamma, eps_start, eps_min, eps_decay, render_every);
-        if (save_path){
-            save_qtable(save_path, &q);
-            printf("Saved Q-table to %s\n", save_path);
+    TrainConfig cfg = {
+        .episodes = train_eps, .alpha = alpha, .gamma = gamma,
+        .eps_start = eps_start, .eps_min = eps_min, .eps_decay = eps_decay,
+        .render_every = render_every, .threads = threads, .sharded = sharded,
+        .check_every = check_every, .check_all = check_all, .shape = shape,
+        .psweep = psweep, .psweep_theta = psweep_theta, .dyna = dyna,
+        .replay = replay, .replay_batch = replay_batch, .replay_sort = replay_sort,
+        .lambda = lambda, .trace_min = trace_min, .backward = backward,
+        .nstep = nstep, .max_seconds = train_seconds, .max_steps = train_steps,
+        .start_mode = start_mode, .start_ramp = start_ramp,
+    };
+    int *dist = NULL;
+    if (check_every>0 || shape || start_mode!=START_FIXED){
+        dist = (int*)malloc(sizeof(int) * (size_t)env.w * (size_t)env.h);
+        if (!dist){ fprintf(stderr, "OOM\n"); return 1; }
+        env_goal_distances(&env, dist, bfs_bitwave ? threads : 0);
+        cfg.dist = dist;
+    }
+    // The check can never pass when the start is cut off from the goal
+    if (until_optimal && train_eps<=0 && train_seconds<=0.0 && train_steps<=0
+        && dist[state_id(&env, env.start_x, env.start_y)] < 0){
+        fprintf(stderr, "Invalid --until-optimal: the goal cannot be reached from the start "
+                        "(add --train N, --train-steps N or --train-seconds T)\n");
+        free(dist);
+        return 1;
+    }
+    if (bench_bfs_flag){
+        bench_bfs(&env, threads);
+    }
+    if (bench_init_flag){
+        bench_init(&env, &cfg, seed, qinit_value, qinit_levels);
+    }
+    if (bench_psweep_flag){
+        bench_psweep(&env, &cfg, seed);
+    }
+    if (bench_dyna_flag){
+        bench_dyna(&env, &cfg, seed);
+    }
+    if (bench_replay_flag){
+        bench_replay(&env, replay, replay_batch, alpha, gamma, seed);
+    }
+    if (bench_lambda_flag){
+        bench_lambda(&env, &cfg, seed);
+    }
+    if (bench_backward_flag){
+        bench_backward(&env, &cfg, seed);
+    }
+    if (bench_nstep_flag){
+        bench_nstep(&env, &cfg, seed);
+    }
+    if (bench_starts_flag){
+        bench_starts(&env, &cfg, seed);
+    }
+    if (bench_curriculum_flag){
+        bench_curriculum(&env, &cfg, seed, curriculum);
+    }
+    if (bench_contract_flag){
+        bench_contract(&env, &cfg, seed, vi_tol);
+    }
+    if (bench_options_flag){
+        bench_options(&env, &cfg, seed);
+    }
+    if (bench_symmetry_flag){
+        bench_symmetry(&env, &cfg, seed);
+    }
+    if (bench_shard){
+        bench_sharded(&env, &cfg, seed);
+    }
+    int benching = bench_shard || bench_init_flag || bench_psweep_flag || bench_dyna_flag
+                   || bench_replay_flag || bench_lambda_flag || bench_backward_flag
+                   || bench_nstep_flag || bench_starts_flag
+                   || bench_curriculum_flag || bench_contract_flag
+                   || bench_options_flag || bench_symmetry_flag;
+    long long trained_eps = 0;
+    void *state = NULL;     // final training state, saved with the table
+    size_t state_bytes = 0;
+    if (training && !benching){
+        int plain = threads<=1 && curriculum<=0 && !contract && !use_options;
+        if (loaded.state && !plain){
+            printf("Training state in %s not resumed (--threads/--curriculum/--contract/"
+                   "--options train afresh)\n", load_path);
+        } else if (loaded.state && (loaded.alpha != alpha || loaded.gamma != gamma
+                   || loaded.eps_start != eps_start || loaded.eps_min != eps_min
+                   || loaded.eps_decay != eps_decay || loaded.step_reward != env.step_reward
+                   || loaded.goal_reward != env.goal_reward)){
+            // Continuing under other settings would not match the saved run
+            printf("Training state in %s not resumed: it was saved with --alpha %g --gamma %g "
+                   "--eps-start %g --eps-min %g --eps-decay %g (rewards %g/%g); "
+                   "pass the same to continue\n", load_path, loaded.alpha, loaded.gamma,
+                   loaded.eps_start, loaded.eps_min, loaded.eps_decay,
+                   loaded.step_reward, loaded.goal_reward);
+        } else if (plain){
+            // Plain train() resumes a loaded state and hands back its own
+            cfg.resume = loaded.state;
+            cfg.resume_bytes = loaded.state_bytes;
         }
+        if (plain && save_path){ cfg.state_out = &state; cfg.state_out_bytes = &state_bytes; }
+        if (checkpoint_every > 0 || checkpoint_seconds > 0.0){
+            cfg.checkpoint_path = save_path;
+            cfg.checkpoint_every = checkpoint_every;
+            cfg.checkpoint_seconds = checkpoint_seconds;
+        }
+        if (threads>1){
+            ParStats st = train_parallel(&env, &q, &cfg, seed);
+            print_par_stats(sharded ? "sharded" : "shared", &st, threads);
+            trained_eps = st.episodes;
+        } else {
+            TrainResult tr = curriculum > 0 ? train_curriculum(&env, &q, &cfg, curriculum, upsample)
+                           : contract ? train_contracted(&env, &q, &cfg)
+                           : use_options ? train_options(&env, &q, &cfg)
+                           : train(&env, &q, &cfg);
+            print_train_result(&tr);
+            trained_eps = tr.episodes;
+        }
+    }
+    if (save_path && (training || vi_method>=0)){
+        QtMeta meta = {
+            .alpha = alpha, .gamma = gamma,
+            .eps_start = eps_start, .eps_min = eps_min, .eps_decay = eps_decay,
+            .step_reward = env.step_reward, .goal_reward = env.goal_reward,
+            .episodes = loaded.episodes + trained_eps,
+        };
+        // With a training state the header counts its completed episodes
+        QtChunk chunk = { state, state_bytes };
+        if (state) meta.episodes = ((const TrainStateHeader*)state)->episodes;
+        int ok;
+        if (env.sym){
+            QModel full;
+            qmodel_unfold(&q, &env, &full);
+            ok = save_qtable_state(save_path, &full, &meta, &chunk, state ? 1 : 0);
+            qmodel_free(&full);
+        } else {
+            ok = save_qtable_state(save_path, &q, &meta, &chunk, state ? 1 : 0);
+        }
+        free(state);
+        if (!ok) return 1;
+        printf("Saved Q-table to %s\n", save_path);
     }
     if (play_eps>0){
         play_greedy(&env, &q, play_eps, render_flag);
     }
+    if (eval_by_graph && !eval_all && eval_sample<=0) eval_all = 1;
+    if (eval_all || eval_sample>0){
+        int *starts;
+        int n = env_free_cells(&env, &starts);
+        if (eval_sample>0 && eval_sample<n){
+            // Partial Fisher-Yates: the first eval_sample entries become the sample
+            Rng rng = { (uint64_t)seed };
+            for (int i=0; i<eval_sample; ++i){
+                int j = i + rng_int(&rng, n-i);
+                int t = starts[i]; starts[i] = starts[j]; starts[j] = t;
+            }
+            n = eval_sample;
+        }
+        EvalSummary e;
+        if (eval_by_graph){
+            eval_graph(&env, &q, starts, n, &e);
+            print_eval("Greedy eval (policy graph)", &e);
+        } else {
+            eval_batch(&env, &q, starts, n, threads, &e);
+            print_eval("Greedy eval", &e);
+        }
+        free(starts);
+    }
 
-    if (train_eps==0 && play_eps==0){
+    if (!training && play_eps==0 && !bench_shard && !eval_all && eval_sample<=0
+        && vi_method<0 && !bench_vi_flag && !bench_bfs_flag && !benching){
         printf("Nothing to do. Try --train 10000 --save q.bin or --load q.bin --play 5 --render\n");
     }
 
+    free(dist);
+    free(loaded.state);
     qmodel_free(&q);
+    symmetry_free(&sym);
+    env_free(&env);
     return 0;
 }
\ No newline at end of file